@@ -2,6 +2,15 @@
 """
 Simple example of serving zpool_prometheus metrics using Flask
 
+A single zpool_prometheus is kept running in execd mode (-e): for each
+request a newline is written to its stdin and its output is read up to
+the "# EOF" line. This avoids starting a new process for each scrape and
+lets zpool_prometheus reuse its memory between collections.
+
+The collect[] query parameters, as in /metrics?collect[]=zpool_scan_*,
+are passed on in that line, as patterns of the pool metric families to
+collect. This lets the histograms be scraped less often than the rest.
+
 Note: if for some reason the zpool_prometheus program hangs, then
 the results are undefined. When planning for production, expect
 that the worst case is zpool_prometheus hangs in the kernel and is
@@ -15,7 +24,8 @@ To run, for testing:
   FLASK_APP=serve_zpool_prometheus.py python -m flask run
 
 To test:
-  curl localhost:5000
+  curl localhost:5000/metrics
+  curl -g 'localhost:5000/metrics?collect[]=zpool_scan_*&collect[]=zpool_stats_*'
 
 Pro tip: use a real WSGI server for production with proper security policies.
 
@@ -50,21 +60,50 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 
 """
-from subprocess import check_output
-from flask import Flask, abort
+from subprocess import Popen, PIPE
+from threading import Lock
+from flask import Flask, abort, request
 app = Flask(__name__)
 
+EOF_MARKER = b'# EOF\n'
+collector = None
+collector_lock = Lock()
+
+
+def collect(patterns):
+    """
+    ask the running zpool_prometheus for a collection, starting it if needed
+
+    :param patterns: list of metric family patterns, empty for all
+    :return: metrics text
+    """
+    global collector
+    if collector is None or collector.poll() is not None:
+        collector = Popen(['zpool_prometheus', '-e'], stdin=PIPE, stdout=PIPE)
+    collector.stdin.write(' '.join(patterns).encode() + b'\n')
+    collector.stdin.flush()
+    lines = []
+    for line in iter(collector.stdout.readline, b''):
+        if line == EOF_MARKER:
+            return b''.join(lines)
+        lines.append(line)
+    raise IOError('zpool_prometheus exited')
+
 
 @app.route("/metrics")
 def get_metrics():
     """
-    run zpool_prometheus and, if successful, return the results
+    collect from zpool_prometheus and, if successful, return the results
 
     :return:
     """
     res = ''
+    # whitespace separates the patterns in the line written
+    patterns = [p for arg in request.args.getlist('collect[]')
+                for p in arg.split()]
     try:
-        res = check_output(['zpool_prometheus'])
+        with collector_lock:
+            res = collect(patterns)
     except Exception:
         abort(500)
     return res
@@ -39,13 +39,34 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/fs/zfs.h>
 #include <time.h>
+#include <math.h>
 #include <libzfs.h>
 #include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
 #include <libnvpair.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define	HAVE_HISTO_AVX2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define	HAVE_HISTO_NEON
+#endif
 
 #define	COMMAND_NAME	"zpool_prometheus"
 #define	POOL_MEASUREMENT	"zpool_stats"
@@ -55,8 +76,49 @@
 #define	MIN_LAT_INDEX		10  /* minimum latency index 10 = 1024ns */
 #define	POOL_IO_SIZE_MEASUREMENT	"zpool_req"
 #define	MIN_SIZE_INDEX		9  /* minimum size index 9 = 512 bytes */
+#define	STREAM_CHUNK		16384  /* stdout buffer size when streaming */
+#define	STREAM_MEMORY_KB	256  /* default snapshot limit when streaming */
+#define	ARENA_CHUNK		16384  /* minimum arena chunk size */
+#define	EXECD_EOF		"# EOF\n"  /* end of output marker for -e */
+#define	ARC_MEASUREMENT		"zfs_arc"
+#define	PROPS_MEASUREMENT	"zpool_props"
+#define	DDT_MEASUREMENT		"zpool_ddt"
+#define	CLASS_MEASUREMENT	"zpool_class"
+#define	TXG_MEASUREMENT		"zpool_txg"
+#define	DATASET_MEASUREMENT	"zfs_dataset"
+#define	DMU_TX_MEASUREMENT	"zpool_dmu_tx_assign"
+#define	IOSTATS_MEASUREMENT	"zpool_iostats"
+#define	IO_MEASUREMENT		"zpool_io"
+#define	ZIL_MEASUREMENT		"zfs_zil"
+#define	ZFETCH_MEASUREMENT	"zfs_zfetch"
+#define	DBUF_MEASUREMENT	"zfs_dbuf"
+#define	ABD_MEASUREMENT		"zfs_abd"
+#define	DMU_TX_STATS_MEASUREMENT	"zfs_dmu_tx"
+#define	EVENT_MEASUREMENT	"zfs_events"
+#define	KSTAT_BUFSIZE		16384  /* initial kstat read buffer size */
+
+/*
+ * where the ZFS kstats live, on Linux
+ */
+#ifndef KSTAT_BASE
+#define	KSTAT_BASE		"/proc/spl/kstat/zfs"
+#endif
+
+/* the persistent device names, see byid_load() */
+#ifndef BYID_DIR
+#define	BYID_DIR	"/dev/disk/by-id"
+#endif
+#define	VDEV_DESC_MAX	1536		/* see get_vdev_desc() */
 
-nvlist_t *metric_names = NULL;  /* list of metric names with help/type */
+/*
+ * histogram sizes, as defined in sys/fs/zfs.h since ZFSonLinux 0.7
+ */
+#ifndef VDEV_L_HISTO_BUCKETS
+#define	VDEV_L_HISTO_BUCKETS	37
+#endif
+#ifndef VDEV_RQ_HISTO_BUCKETS
+#define	VDEV_RQ_HISTO_BUCKETS	25
+#endif
 
 /*
  * in cases where ZFS is installed, but not the ZFS dev environment, copy in
@@ -77,720 +139,5151 @@ struct zpool_handle {
 #endif
 
 /*
- * though the prometheus docs don't seem to mention how to handle strange
- * characters for labels, we'll try a conservative approach and filter as if
- * the pool name is an unknowable string.
- *
- * caller is responsible for freeing result
+ * short_names become part of the metric name. For historical reasons, the
+ * latency metric names use the nvlist name instead.
  */
-char *
-escape_string(char *s) {
-	char *c, *d;
-	char *t = (char *) malloc(ZFS_MAX_DATASET_NAME_LEN << 1);
-	if (t == NULL) {
-		fprintf(stderr, "error: cannot allocate memory\n");
-		exit(1);
-	}
+typedef struct stat_lookup {
+	char *name;
+	char *short_name;
+} stat_lookup_t;
 
-	for (c = s, d = t; *c != '\0'; c++, d++) {
-		switch (*c) {
-			case '"':
-			case '\\':
-				*d++ = '\\';
-			default:
-				*d = *c;
-		}
-	}
-	*d = '\0';
-	return (t);
-}
+stat_lookup_t lat_type[] = {
+	{ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO,	"total_read"},
+	{ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO,	"total_write"},
+	{ZPOOL_CONFIG_VDEV_DISK_R_LAT_HISTO,	"disk_read"},
+	{ZPOOL_CONFIG_VDEV_DISK_W_LAT_HISTO,	"disk_write"},
+	{ZPOOL_CONFIG_VDEV_SYNC_R_LAT_HISTO,	"sync_read"},
+	{ZPOOL_CONFIG_VDEV_SYNC_W_LAT_HISTO,	"sync_write"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_R_LAT_HISTO,	"async_read"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_W_LAT_HISTO,	"async_write"},
+	{ZPOOL_CONFIG_VDEV_SCRUB_LAT_HISTO,	"scrub"},
+#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
+	{ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO,	"trim"},
+#endif
+};
+#define	LAT_TYPES	(sizeof (lat_type) / sizeof (lat_type[0]))
+
+stat_lookup_t size_type[] = {
+	{ZPOOL_CONFIG_VDEV_SYNC_IND_R_HISTO,	"sync_read_ind"},
+	{ZPOOL_CONFIG_VDEV_SYNC_IND_W_HISTO,	"sync_write_ind"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_IND_R_HISTO,	"async_read_ind"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_IND_W_HISTO,	"async_write_ind"},
+	{ZPOOL_CONFIG_VDEV_IND_SCRUB_HISTO,	"scrub_read_ind"},
+	{ZPOOL_CONFIG_VDEV_SYNC_AGG_R_HISTO,	"sync_read_agg"},
+	{ZPOOL_CONFIG_VDEV_SYNC_AGG_W_HISTO,	"sync_write_agg"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_AGG_R_HISTO,	"async_read_agg"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_AGG_W_HISTO,	"async_write_agg"},
+	{ZPOOL_CONFIG_VDEV_AGG_SCRUB_HISTO,	"scrub_read_agg"},
+#ifdef ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO
+	{ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO,	"trim_write_ind"},
+	{ZPOOL_CONFIG_VDEV_AGG_TRIM_HISTO,	"trim_write_agg"},
+#endif
+};
+#define	SIZE_TYPES	(sizeof (size_type) / sizeof (size_type[0]))
+
+stat_lookup_t queue_type[] = {
+	{ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE,  "sync_r_active_queue"},
+	{ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE,  "sync_w_active_queue"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE, "async_r_active_queue"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE, "async_w_active_queue"},
+	{ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,   "async_scrub_active_queue"},
+	{ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE,    "sync_r_pend_queue"},
+	{ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE,    "sync_w_pend_queue"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE,   "async_r_pend_queue"},
+	{ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE,   "async_w_pend_queue"},
+	{ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,     "async_scrub_pend_queue"},
+};
+#define	QUEUE_TYPES	(sizeof (queue_type) / sizeof (queue_type[0]))
 
 /*
- * print help or type values for a given metric name
+ * The histogram metric names and bucket boundaries never change, so the
+ * strings are built once at startup by init_histo_names(). Each le string
+ * includes the end of the label set, ready to be followed by the value.
  */
-void
-print_help_type(char *metric_name, char *help, char *type) {
-	char *strval;
-	if (nvlist_lookup_string(metric_names, metric_name, &strval) != 0) {
-		if (help != NULL)
-			(void) printf("# HELP %s %s\n", metric_name, help);
-		if (type != NULL)
-			(void) printf("# TYPE %s %s\n", metric_name, type);
-		if (nvlist_add_string(metric_names, metric_name, "") != 0) {
-			fprintf(stderr, "error: cannot allocate memory\n");
-			exit(1);
-		}
-	}
-}
+typedef struct histo_names {
+	char *family;		/* for HELP and TYPE */
+	char *bucket;
+	char *sum;
+	char *count;
+} histo_names_t;
+
+histo_names_t lat_names[LAT_TYPES];
+histo_names_t size_names[SIZE_TYPES];
+char *lat_le[VDEV_L_HISTO_BUCKETS];
+char *size_le[VDEV_RQ_HISTO_BUCKETS];
+char *inf_le = ",le=\"+Inf\"} ";
+char *no_le = "} ";
 
 /*
- * As of early 2019, prometheus only has a float64 data type.
- * This is unfortunate because ZFS uses mostly uint64 data type.
- * For high-speed systems or slow-speed systems that have been up
- * for a long time, these counters will overflow the significand,
- * causing queries that take derivatives or differences to seemingly
- * fail. Since most of these counters are only counting up, we can
- * mask them to fit in the significand and reset to zero when full.
- * Queries that then use non-negative derivatives (a best practice)
- * will handle it nicely.
+ * The vdev stats exported are described by static tables of
+ * vs_field_desc_t, giving the metric name, help, type, where the value is
+ * in vdev_stat_t, and how it is derived. Collection and rendering are
+ * driven by the tables, so adding a field is adding an entry.
  */
-#define SIGNIFICANT_BITS 52
+typedef enum vs_op {
+	VS_OP_COPY,
+	VS_OP_FREE,		/* vs_space - vs_alloc */
+	VS_OP_PERCENT,		/* percent, printed as a ratio */
+	VS_OP_IF_STATE		/* only while state is state_value */
+} vs_op_t;
 
-void
-print_prom_u64(char *prefix, char *metric, char *label, uint64_t value,
-               char *help, char *type) {
-	char metric_name[200];
-	uint64_t mask = ((1ULL << SIGNIFICANT_BITS) - 1);
+typedef struct vs_field_desc {
+	char	*name;
+	char	*help;
+	char	*type;
+	size_t	offset;
+	vs_op_t	op;
+	size_t	state;		/* for VS_OP_IF_STATE */
+	uint64_t state_value;
+} vs_field_desc_t;
 
-	(void) snprintf(metric_name, sizeof(metric_name), "%s_%s", prefix,
-	    metric);
-	print_help_type(metric_name, help, type);
-	if (label != NULL)
-		(void) printf("%s{%s} %"PRIu64"\n", metric_name, label,
-		    value & mask);
-	else
-		(void) printf("%s %"PRIu64"\n", metric_name, value & mask);
-}
+#define	VS_FIELD(f)	offsetof(vdev_stat_t, f)
 
 /*
- * doubles are native data type for prometheus, send them through unimpeded
+ * summary stats are copied out of vdev_stat_t, one column per metric
  */
-void
-print_prom_d(char *prefix, char *metric, char *label, double value,
-             char *help, char *type) {
-	char metric_name[200];
-	(void) snprintf(metric_name, sizeof(metric_name), "%s_%s", prefix,
-	    metric);
-	print_help_type(metric_name, help, type);
-	if (label != NULL)
-		(void) printf("%s{%s} %f\n", metric_name, label, value);
-	else
-		(void) printf("%s %f\n", metric_name, value);
-}
+typedef enum vs_column {
+	VS_STATE,
+	VS_AUX_STATE,
+	VS_ALLOC_BYTES,
+	VS_FREE_BYTES,
+	VS_SIZE_BYTES,
+	VS_READ_BYTES,
+	VS_READ_ERRORS,
+	VS_READ_OPS,
+	VS_WRITE_BYTES,
+	VS_WRITE_ERRORS,
+	VS_WRITE_OPS,
+	VS_CKSUM_ERRORS,
+	VS_FRAGMENTATION,
+	VS_COLUMNS
+} vs_column_t;
+
+vs_field_desc_t vs_column_desc[VS_COLUMNS] = {
+	[VS_STATE] = {"state",	"current state, see zfs.h", "gauge",
+	    VS_FIELD(vs_state)},
+	[VS_AUX_STATE] = {"aux_state", "auxiliary state, see zfs.h", "gauge",
+	    VS_FIELD(vs_aux)},
+	[VS_ALLOC_BYTES] = {"alloc_bytes", "allocated size", "gauge",
+	    VS_FIELD(vs_alloc)},
+	[VS_FREE_BYTES] = {"free_bytes", "free space",	"gauge",
+	    VS_FIELD(vs_space), VS_OP_FREE},
+	[VS_SIZE_BYTES] = {"size_bytes", "pool size",	"gauge",
+	    VS_FIELD(vs_space)},
+	[VS_READ_BYTES] = {"read_bytes", "read bytes",	"counter",
+	    VS_FIELD(vs_bytes[ZIO_TYPE_READ])},
+	[VS_READ_ERRORS] = {"read_errors", "read errors", "counter",
+	    VS_FIELD(vs_read_errors)},
+	[VS_READ_OPS] = {"read_ops", "read ops",	"counter",
+	    VS_FIELD(vs_ops[ZIO_TYPE_READ])},
+	[VS_WRITE_BYTES] = {"write_bytes", "write bytes", "counter",
+	    VS_FIELD(vs_bytes[ZIO_TYPE_WRITE])},
+	[VS_WRITE_ERRORS] = {"write_errors", "write errors", "counter",
+	    VS_FIELD(vs_write_errors)},
+	[VS_WRITE_OPS] = {"write_ops", "write ops",	"counter",
+	    VS_FIELD(vs_ops[ZIO_TYPE_WRITE])},
+	[VS_CKSUM_ERRORS] = {"cksum_errors", "checksum errors", "counter",
+	    VS_FIELD(vs_checksum_errors)},
+	[VS_FRAGMENTATION] = {"fragmentation_ratio",
+	    "free space fragmentation metric", "gauge",
+	    VS_FIELD(vs_fragmentation), VS_OP_PERCENT},
+};
 
 /*
- * print_scan_status() prints the details as often seen in the "zpool status"
- * output. However, unlike the zpool command, which is intended for humans,
- * this output is suitable for long-term tracking in prometheus.
+ * Leaf vdev stats are only exported for leaf vdevs. A kernel older than
+ * the headers has a shorter vdev_stat_t, so a field is only exported if
+ * the kernel's copy has it.
  */
-int
-print_scan_status(nvlist_t *nvroot, const char *pool_name) {
-	uint_t c;
-	int64_t elapsed;
-	uint64_t examined, pass_exam, paused_time, paused_ts, rate;
-	uint64_t remaining_time;
-	pool_scan_stat_t *ps = NULL;
-	double pct_done;
-	char *state[DSS_NUM_STATES] = {"none", "scanning", "finished",
-	                               "canceled"};
-	char *func = "unknown_function";
-	char *p = SCAN_MEASUREMENT;
-	char l[2 * ZFS_MAX_DATASET_NAME_LEN];  /* prometheus label */
+vs_field_desc_t leaf_field_desc[] = {
+	{"zio_free_ops",	"free ops",	"counter",
+	    VS_FIELD(vs_ops[ZIO_TYPE_FREE])},
+	{"zio_free_bytes",	"free bytes",	"counter",
+	    VS_FIELD(vs_bytes[ZIO_TYPE_FREE])},
+	{"zio_claim_ops",	"claim ops",	"counter",
+	    VS_FIELD(vs_ops[ZIO_TYPE_CLAIM])},
+	{"zio_claim_bytes",	"claim bytes",	"counter",
+	    VS_FIELD(vs_bytes[ZIO_TYPE_CLAIM])},
+	{"zio_ioctl_ops",	"ioctl ops",	"counter",
+	    VS_FIELD(vs_ops[ZIO_TYPE_IOCTL])},
+	{"zio_ioctl_bytes",	"ioctl bytes",	"counter",
+	    VS_FIELD(vs_bytes[ZIO_TYPE_IOCTL])},
+	{"rsize_bytes",		"replaceable device size", "gauge",
+	    VS_FIELD(vs_rsize)},
+	{"esize_bytes",		"expandable device size", "gauge",
+	    VS_FIELD(vs_esize)},
+	{"self_healed_bytes",	"bytes repaired",	"counter",
+	    VS_FIELD(vs_self_healed)},
+#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
+	/* added with TRIM support */
+	{"zio_trim_ops",	"trim ops",	"counter",
+	    VS_FIELD(vs_ops[ZIO_TYPE_TRIM])},
+	{"zio_trim_bytes",	"trim bytes",	"counter",
+	    VS_FIELD(vs_bytes[ZIO_TYPE_TRIM])},
+	{"slow_ios",		"slow I/Os",	"counter",
+	    VS_FIELD(vs_slow_ios)},
+	{"checkpoint_space_bytes", "checkpoint space", "gauge",
+	    VS_FIELD(vs_checkpoint_space)},
+	{"initialize_errors",	"initialize errors", "counter",
+	    VS_FIELD(vs_initialize_errors)},
+	{"initialize_done_bytes", "bytes initialized", "gauge",
+	    VS_FIELD(vs_initialize_bytes_done)},
+	{"initialize_estimate_bytes", "bytes to initialize", "gauge",
+	    VS_FIELD(vs_initialize_bytes_est)},
+	{"initialize_state",	"initialize state, see zfs.h", "gauge",
+	    VS_FIELD(vs_initialize_state)},
+	{"initialize_action_ts_seconds",
+	    "initialize last action timestamp (epoch)", "gauge",
+	    VS_FIELD(vs_initialize_action_time)},
+	{"initialize_start_ts_seconds",
+	    "running initialize start timestamp (epoch)", "gauge",
+	    VS_FIELD(vs_initialize_action_time), VS_OP_IF_STATE,
+	    VS_FIELD(vs_initialize_state), VDEV_INITIALIZE_ACTIVE},
+	{"initialize_end_ts_seconds",
+	    "completed initialize end timestamp (epoch)", "gauge",
+	    VS_FIELD(vs_initialize_action_time), VS_OP_IF_STATE,
+	    VS_FIELD(vs_initialize_state), VDEV_INITIALIZE_COMPLETE},
+	{"trim_errors",		"trim errors",	"counter",
+	    VS_FIELD(vs_trim_errors)},
+	{"trim_notsup",		"trim not supported", "gauge",
+	    VS_FIELD(vs_trim_notsup)},
+	{"trim_done_bytes",	"bytes trimmed", "gauge",
+	    VS_FIELD(vs_trim_bytes_done)},
+	{"trim_estimate_bytes",	"bytes to trim", "gauge",
+	    VS_FIELD(vs_trim_bytes_est)},
+	{"trim_state",		"trim state, see zfs.h", "gauge",
+	    VS_FIELD(vs_trim_state)},
+	{"trim_action_ts_seconds", "trim last action timestamp (epoch)",
+	    "gauge", VS_FIELD(vs_trim_action_time)},
+	{"trim_start_ts_seconds", "running trim start timestamp (epoch)",
+	    "gauge", VS_FIELD(vs_trim_action_time), VS_OP_IF_STATE,
+	    VS_FIELD(vs_trim_state), VDEV_TRIM_ACTIVE},
+	{"trim_end_ts_seconds", "completed trim end timestamp (epoch)",
+	    "gauge", VS_FIELD(vs_trim_action_time), VS_OP_IF_STATE,
+	    VS_FIELD(vs_trim_state), VDEV_TRIM_COMPLETE},
+#endif
+};
+#define	LEAF_FIELDS	(sizeof (leaf_field_desc) / sizeof (leaf_field_desc[0]))
 
-	(void) nvlist_lookup_uint64_array(nvroot,
-	    ZPOOL_CONFIG_SCAN_STATS,
-	    (uint64_t **) &ps, &c);
+/*
+ * Progress rates of the initialize and TRIM runs on leaf vdevs are
+ * computed here, from the bytes done over the last PROGRESS_SAMPLES
+ * collections, while the run is active. So they are only available in
+ * execd mode.
+ */
+#define	PROGRESS_SAMPLES	8
 
-	/*
-	 * ignore if there are no stats or state is bogus
-	 */
-	if (ps == NULL || ps->pss_state >= DSS_NUM_STATES ||
-	    ps->pss_func >= POOL_SCAN_FUNCS)
-		return (0);
+typedef struct progress_desc {
+	char	*name;
+	char	*help;
+	size_t	done;		/* bytes done, in vdev_stat_t */
+	size_t	state;
+	uint64_t active;
+} progress_desc_t;
 
-	switch (ps->pss_func) {
-		case POOL_SCAN_NONE:
-			func = "none_requested";
-			break;
-		case POOL_SCAN_SCRUB:
-			func = "scrub";
-			break;
-		case POOL_SCAN_RESILVER:
-			func = "resilver";
-			break;
-#ifdef POOL_SCAN_REBUILD
-		case POOL_SCAN_REBUILD:
-				func = "rebuild";
-				break;
+progress_desc_t progress_desc[] = {
+#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
+	{"initialize_rate_bytes_per_second", "initialize rate",
+	    VS_FIELD(vs_initialize_bytes_done), VS_FIELD(vs_initialize_state),
+	    VDEV_INITIALIZE_ACTIVE},
+	{"trim_rate_bytes_per_second", "trim rate",
+	    VS_FIELD(vs_trim_bytes_done), VS_FIELD(vs_trim_state),
+	    VDEV_TRIM_ACTIVE},
 #endif
-		default:
-			func = "scan";
-	}
+};
+#define	PROGRESS_TYPES	(sizeof (progress_desc) / sizeof (progress_desc[0]))
 
-	/* overall progress */
-	examined = ps->pss_examined ? ps->pss_examined : 1;
-	pct_done = 0.0;
-	if (ps->pss_to_examine > 0)
-		pct_done = 100.0 * examined / ps->pss_to_examine;
+typedef struct progress_ring {
+	double		pr_time[PROGRESS_SAMPLES];
+	uint64_t	pr_done[PROGRESS_SAMPLES];
+	uint_t		pr_next;
+	uint_t		pr_count;
+} progress_ring_t;
 
-#ifdef EZFS_SCRUB_PAUSED
-	paused_ts = ps->pss_pass_scrub_pause;
-			paused_time = ps->pss_pass_scrub_spent_paused;
+/*
+ * the samples of a leaf vdev, found by guid in an open addressed table
+ */
+typedef struct progress {
+	uint64_t	pg_guid;		/* 0 = free */
+	progress_ring_t	pg_ring[PROGRESS_TYPES];
+} progress_t;
+
+progress_t *progress_table = NULL;
+uint_t progress_size = 0;		/* a power of 2 */
+uint_t progress_used = 0;
+
+/*
+ * scan stats are computed per pool, one value per metric
+ */
+typedef enum scan_metric {
+	SCAN_START_TS,
+	SCAN_END_TS,
+	SCAN_PAUSE_TS,
+	SCAN_PAUSED,
+	SCAN_REMAINING_TIME,
+	SCAN_ERRORS,
+	SCAN_EXAMINED,
+	SCAN_EXAMINED_PASS,
+	SCAN_PCT_DONE,
+	SCAN_PROCESSED,
+	SCAN_RATE,
+	SCAN_TO_EXAMINE,
+	SCAN_TO_PROCESS,
+	SCAN_ISSUED,
+	SCAN_ISSUED_RATE,
+	SCAN_METRICS
+} scan_metric_t;
+
+struct scan_metric_desc {
+	char *name;
+	char *help;
+	char *type;
+	boolean_t is_double;
+} scan_metric_desc[SCAN_METRICS] = {
+	{"start_ts_seconds",	"scan start timestamp (epoch)",	"gauge"},
+	{"end_ts_seconds",	"scan end timestamp (epoch)",	"gauge"},
+	{"pause_ts_seconds",	"scan paused at timestamp (epoch)", "gauge"},
+	{"paused_seconds",	"scan pause duration",		"gauge"},
+	{"remaining_time_seconds",
+	    "estimate of scan time remaining",			"gauge",
+	    B_TRUE},
+	{"errors",		"errors detected during scan)",	"counter"},
+	{"examined_bytes",	"bytes examined",		"counter"},
+	{"examined_pass_bytes",	"bytes examined for this pass",	"counter"},
+	{"percent_done_ratio",	"percent of bytes examined",	"gauge",
+	    B_TRUE},
+	{"processed_bytes",	"total bytes processed",	"counter"},
+	{"examined_bytes_per_second",
+	    "recent examination rate",				"gauge",
+	    B_TRUE},
+	{"to_examine_bytes",	"bytes remaining to examine",	"gauge"},
+	{"to_process_bytes",	"bytes remaining to process",	"gauge"},
+	{"issued_bytes",	"bytes issued",			"counter"},
+	{"issued_bytes_per_second",
+	    "recent issue rate",				"gauge",
+	    B_TRUE},
+};
+
+/*
+ * The dedup table stats, from the pool config: its size, the totals of
+ * the DDT, and the histogram of references per unique block, where
+ * bucket i counts the blocks with [2^i, 2^(i+1)) references. References
+ * above 2^DDT_HISTO_BUCKETS - 1 are only counted in +Inf.
+ */
+typedef enum ddt_metric {
+	DDT_ENTRIES,
+	DDT_DISK_BYTES,
+	DDT_CORE_BYTES,
+	DDT_BLOCKS,
+	DDT_LSIZE,
+	DDT_PSIZE,
+	DDT_DSIZE,
+	DDT_REF_BLOCKS,
+	DDT_REF_LSIZE,
+	DDT_REF_PSIZE,
+	DDT_REF_DSIZE,
+	DDT_REFCOUNT,			/* histogram */
+	DDT_METRICS
+} ddt_metric_t;
+
+#define	DDT_HISTO_BUCKETS	24
+#define	DDT_VALUES		(DDT_REFCOUNT + DDT_HISTO_BUCKETS)
+
+struct ddt_metric_desc {
+	char *name;
+	char *help;
+	char *type;
+} ddt_metric_desc[DDT_METRICS] = {
+	{"entries",		"DDT entries",			"gauge"},
+	{"disk_bytes",		"DDT size on disk",		"gauge"},
+	{"core_bytes",		"DDT size in core",		"gauge"},
+	{"blocks",		"unique blocks",		"gauge"},
+	{"logical_bytes",	"logical size of unique blocks", "gauge"},
+	{"physical_bytes",	"physical size of unique blocks", "gauge"},
+	{"allocated_bytes",	"allocated size of unique blocks", "gauge"},
+	{"referenced_blocks",	"blocks referenced",		"gauge"},
+	{"referenced_logical_bytes",
+	    "logical size of blocks referenced",		"gauge"},
+	{"referenced_physical_bytes",
+	    "physical size of blocks referenced",		"gauge"},
+	{"referenced_allocated_bytes",
+	    "allocated size of blocks referenced",		"gauge"},
+	{"refcount",		"references per unique block",	"histogram"},
+};
+
+histo_names_t ddt_names = {
+	DDT_MEASUREMENT "_refcount",
+	DDT_MEASUREMENT "_refcount_bucket",
+	DDT_MEASUREMENT "_refcount_sum",
+	DDT_MEASUREMENT "_refcount_count",
+};
+char *ddt_le[DDT_HISTO_BUCKETS];
+
+/*
+ * Top-level vdevs belong to an allocation class, from their allocation
+ * bias, and their children to the same class. Cache and spare devices
+ * are not in the vdev tree, but in arrays beside it. The root has no
+ * class.
+ */
+typedef enum vdev_class {
+	VC_NONE,
+	VC_NORMAL,
+	VC_SPECIAL,
+	VC_DEDUP,
+	VC_LOG,
+	VC_CACHE,
+	VC_SPARE,
+	VDEV_CLASSES
+} vdev_class_t;
+
+char *vdev_class_name[VDEV_CLASSES] = {
+	NULL, "normal", "special", "dedup", "log", "cache", "spare"
+};
+
+/*
+ * The per class stats are summed over the top-level vdevs of each class,
+ * whose latency histograms already count the I/Os of their children.
+ */
+typedef enum class_space {
+	CLASS_SIZE_BYTES,
+	CLASS_ALLOC_BYTES,
+	CLASS_FREE_BYTES,
+	CLASS_SPACE
+} class_space_t;
+
+vs_column_t class_space_column[CLASS_SPACE] = {
+	VS_SIZE_BYTES,
+	VS_ALLOC_BYTES,
+	VS_FREE_BYTES,
+};
+
+histo_names_t class_lat_names[LAT_TYPES];
+char *class_desc[VDEV_CLASSES];		/* class="<name>" */
+
+/*
+ * Scan rates are exponentially weighted moving averages of the rates
+ * between collections, with a time constant of SCAN_RATE_TAU seconds, so
+ * that they follow the recent rate, such as after a pause. They are
+ * seeded with the average rate of the current pass, which is all there
+ * is for a single collection.
+ */
+#define	SCAN_RATE_TAU	60.0
+
+/*
+ * Sequential scans, which issue the examined bytes later, came in 0.8,
+ * with TRIM. Before, the bytes are issued as they are examined.
+ */
+#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
+#define	PSS_ISSUED(ps)		((ps)->pss_issued)
+#define	PSS_PASS_ISSUED(ps)	((ps)->pss_pass_issued)
 #else
-	paused_ts = 0;
-	paused_time = 0;
+#define	PSS_ISSUED(ps)		((ps)->pss_examined)
+#define	PSS_PASS_ISSUED(ps)	((ps)->pss_pass_exam)
 #endif
 
-	/* calculations for this pass */
-	if (ps->pss_state == DSS_SCANNING) {
-		elapsed = time(NULL) - ps->pss_pass_start - paused_time;
-		elapsed = (elapsed > 0) ? elapsed : 1;
-		pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
-		rate = pass_exam / elapsed;
-		rate = (rate > 0) ? rate : 1;
-		remaining_time = ps->pss_to_examine - examined / rate;
-	} else {
-		elapsed = ps->pss_end_time - ps->pss_pass_start - paused_time;
-		elapsed = (elapsed > 0) ? elapsed : 1;
-		pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
-		rate = pass_exam / elapsed;
-		remaining_time = 0;
+typedef struct scan_rate {
+	char		*sr_pool;		/* escaped pool name */
+	uint64_t	sr_start;		/* pss_start_time of the scan */
+	double		sr_time;		/* of the last sample, 0 = none */
+	uint64_t	sr_examined;
+	uint64_t	sr_issued;
+	double		sr_examine_rate;
+	double		sr_issue_rate;
+} scan_rate_t;
+
+scan_rate_t *scan_rates = NULL;
+uint_t scan_nrates = 0;
+
+/*
+ * Metric families are rendered one at a time. They are grouped by the
+ * part of the config they come from, so that collection can be limited
+ * to one group at a time.
+ */
+typedef enum family_group {
+	FG_SUMMARY,
+	FG_LEAF,
+	FG_PROGRESS,
+	FG_LATENCY,
+	FG_SIZE,
+	FG_QUEUE,
+	FG_SCAN,
+	FG_DDT,
+	FG_CLASS,
+	FG_GROUPS
+} family_group_t;
+
+#define	FG_ALL	((1 << FG_GROUPS) - 1)
+#define	FG_VDEV	((1 << FG_SCAN) - 1)	/* groups collected per vdev */
+
+/*
+ * Every metric family has an id, family_base[g] + i for family i of
+ * group g, indexing its precomputed name, help, and type.
+ */
+typedef struct family_desc {
+	char	*fd_name;
+	char	*fd_help;
+	char	*fd_type;
+} family_desc_t;
+
+#define	FAMILY_ID(g, i)	(family_base[g] + (i))
+
+family_desc_t *families;
+uint_t family_base[FG_GROUPS];
+uint_t nfamilies;
+uint_t family_words;
+
+uint_t family_count[FG_GROUPS] = {
+	VS_COLUMNS,
+	LEAF_FIELDS,
+	PROGRESS_TYPES,
+	LAT_TYPES,
+	SIZE_TYPES,
+	QUEUE_TYPES,
+	SCAN_METRICS,
+	DDT_METRICS,
+	CLASS_SPACE + LAT_TYPES,
+};
+
+/*
+ * The pool properties and the per-pool kstats are not in the snapshot,
+ * but their families are filtered the same way, with ids from
+ * family_kbase[k]. A source with no family in the set is not read.
+ */
+typedef enum kstat_group {
+	KG_PROPS,
+	KG_TXG,
+	KG_DMU_TX,
+	KG_DATASET,
+	KG_IO,
+	KG_GROUPS
+} kstat_group_t;
+
+#define	KFAMILY_ID(k, i)	(family_kbase[k] + (i))
+
+uint_t family_kbase[KG_GROUPS];
+uint_t family_kcount[KG_GROUPS];	/* see init_kstat_families() */
+
+/*
+ * Metric families can be filtered by name, with fnmatch(3) patterns from
+ * -i, -x, or a filter file, and in execd mode per scrape, by patterns on
+ * the line read, such as the collect[] query parameters passed on by
+ * serve_zpool_prometheus.py. The patterns are compiled once into a set
+ * of family ids, so a scrape tests a bit per family, and the groups
+ * with no family in the set are not collected at all. The sets have
+ * family_words words, known once the families are.
+ */
+typedef struct family_set {
+	uint64_t	*fs_bits;
+	uint_t		fs_groups;	/* groups with a family in the set */
+	uint_t		fs_kgroups;	/* same, for the kstat groups */
+} family_set_t;
+
+#define	FAMILY_IN(fs, id)	\
+	((fs)->fs_bits[(id) / 64] & (1ULL << ((id) % 64)))
+#define	FAMILY_ON(g, i)		FAMILY_IN(family_on, FAMILY_ID(g, i))
+#define	KFAMILY_ON(k, i)	FAMILY_IN(family_on, KFAMILY_ID(k, i))
+#define	KGROUP_ON(k)		(family_on->fs_kgroups & (1 << (k)))
+
+typedef struct family_filter {
+	char		**ff_include;
+	uint_t		ff_ninclude;
+	char		**ff_exclude;
+	uint_t		ff_nexclude;
+} family_filter_t;
+
+family_filter_t family_filter;		/* from -i, -x, and -f */
+family_set_t family_config;		/* family_filter, compiled */
+family_set_t *family_on = &family_config;	/* for this collection */
+
+/* the compiled filters of the most recent distinct scrape lines */
+#define	SCRAPE_LINE_MAX	1024
+#define	SCRAPE_FILTERS	8
+
+typedef struct scrape_filter {
+	char		sf_line[SCRAPE_LINE_MAX];
+	family_set_t	sf_set;
+} scrape_filter_t;
+
+scrape_filter_t scrape_filters[SCRAPE_FILTERS];
+uint_t scrape_nfilters;
+uint_t scrape_next;			/* slot replaced next */
+
+/*
+ * Cardinality controls. The vdev groups can be limited to a depth of
+ * the vdev tree, such as latency for the top-level vdevs only, and the
+ * vdev series can be capped, see pool_depth_limit(). Both are applied
+ * while walking the tree, so vdevs that are not exported are not read.
+ */
+char *family_group_name[FG_GROUPS] = {
+	"summary", "leaf", "progress", "latency", "size", "queue", "scan",
+	"ddt", "class"
+};
+
+#define	DEPTH_UNLIMITED	UINT_MAX
+#define	DEPTH_COUNT_MAX	16		/* deeper vdevs are counted here */
+
+uint_t group_max_depth[FG_GROUPS];
+uint64_t series_cap = 0;		/* 0 = no cap */
+uint64_t series_left;			/* in this collection */
+
+/* optional vdev labels, which -L can omit */
+typedef enum vdev_label {
+	VL_CLASS,
+	VL_GUID,
+	VL_PATH,
+	VL_DEVID,
+	VL_PHYS_PATH,
+	VL_BY_ID,
+	VDEV_LABELS
+} vdev_label_t;
+
+char *vdev_label_name[VDEV_LABELS] = {
+	"class", "guid", "path", "devid", "phys_path", "by_id"
+};
+
+uint_t label_omit = 0;			/* bitmask of vdev_label_t */
+#define	LABEL(l)	(!(label_omit & (1 << (l))))
+
+/*
+ * family groups wanted for vdevs at a depth
+ */
+uint_t
+depth_groups(uint_t depth) {
+	uint_t mask = 0;
+
+	for (int g = 0; g < FG_GROUPS; g++) {
+		if (depth <= group_max_depth[g])
+			mask |= 1 << g;
+	}
+	return (mask);
+}
+
+/*
+ * parse a comma separated list of <group>=<depth>
+ */
+int
+depth_limits_parse(char *list) {
+	char *item, *last, *depth, *end;
+	int g;
+
+	for (item = strtok_r(list, ",", &last); item != NULL;
+	    item = strtok_r(NULL, ",", &last)) {
+		if ((depth = strchr(item, '=')) == NULL)
+			goto bad;
+		*depth++ = '\0';
+		/* only the groups collected per vdev have a depth */
+		for (g = 0; g < FG_GROUPS; g++) {
+			if ((FG_VDEV & (1 << g)) &&
+			    strcmp(family_group_name[g], item) == 0)
+				break;
+		}
+		if (g == FG_GROUPS || *depth == '\0')
+			goto bad;
+		group_max_depth[g] = strtoul(depth, &end, 10);
+		if (*end != '\0')
+			goto bad;
 	}
-	rate = rate ? rate : 1;
-
-	(void) snprintf(l, sizeof(l), "name=\"%s\",state=\"%s\"", pool_name,
-	    state[ps->pss_state]);
-	print_prom_u64(p, "start_ts_seconds", l, ps->pss_start_time,
-	    "scan start timestamp (epoch)", "gauge");
-	print_prom_u64(p, "end_ts_seconds", l, ps->pss_end_time,
-	    "scan end timestamp (epoch)", "gauge");
-	print_prom_u64(p, "pause_ts_seconds", l, paused_ts,
-	    "scan paused at timestamp (epoch)", "gauge");
-	print_prom_u64(p, "paused_seconds", l, paused_time,
-	    "scan pause duration", "gauge");
-	print_prom_u64(p, "remaining_time_seconds", l, remaining_time,
-	    "estimate of examination time remaining", "gauge");
-
-	print_prom_u64(p, "errors", l, ps->pss_errors,
-	    "errors detected during scan)", "counter");
-	print_prom_u64(p, "examined_bytes", l, examined,
-	    "bytes examined", "counter");
-	print_prom_u64(p, "examined_pass_bytes", l, pass_exam,
-	    "bytes examined for this pass", "counter");
-	print_prom_d(p, "percent_done_ratio", l, pct_done,
-	    "percent of bytes examined", "gauge");
-	print_prom_u64(p, "processed_bytes", l, ps->pss_processed,
-	    "total bytes processed", "counter");
-	print_prom_u64(p, "examined_bytes_per_second", l, rate,
-	    "examination rate over current pass", "gauge");
-	print_prom_u64(p, "to_examine_bytes", l, ps->pss_to_examine,
-	    "bytes remaining to examine", "gauge");
-	print_prom_u64(p, "to_process_bytes", l, ps->pss_to_process,
-	    "bytes remaining to process", "gauge");
+	return (0);
+bad:
+	fprintf(stderr, "error: bad depth limit %s\n", item);
+	return (-1);
+}
+
+/*
+ * parse a comma separated list of vdev labels to omit
+ */
+int
+labels_omit_parse(char *list) {
+	char *name, *last;
+	int l;
 
+	for (name = strtok_r(list, ",", &last); name != NULL;
+	    name = strtok_r(NULL, ",", &last)) {
+		for (l = 0; l < VDEV_LABELS; l++) {
+			if (strcmp(vdev_label_name[l], name) == 0)
+				break;
+		}
+		if (l == VDEV_LABELS) {
+			fprintf(stderr, "error: unknown label %s\n", name);
+			return (-1);
+		}
+		label_omit |= 1 << l;
+	}
 	return (0);
 }
 
 /*
+ * Temporary strings for a collection, such as the escaped pool names and
+ * the vdev descriptions, come from a bump arena that is reset in O(1)
+ * once the collection is printed. Should a collection not fit in one
+ * chunk, more chunks are chained and, at reset, replaced by one chunk
+ * large enough for all of them. Thus in steady state, collecting does
+ * not malloc or free.
+ */
+typedef struct arena_chunk {
+	struct arena_chunk *ac_next;
+	size_t		ac_size;
+	size_t		ac_used;
+	char		ac_data[];
+} arena_chunk_t;
+
+typedef struct arena {
+	arena_chunk_t	*a_first;
+	arena_chunk_t	*a_cur;		/* chunks after a_cur are unused */
+	uint64_t	a_allocs;	/* allocations, ever */
+} arena_t;
+
+typedef struct arena_mark {
+	arena_chunk_t	*am_chunk;
+	size_t		am_used;
+} arena_mark_t;
+
+/*
+ * A snapshot holds everything collected from the pool configs during one
+ * pass, laid out in flat arrays indexed by vdev ordinal. Vdevs are numbered
+ * in tree-walk order across all pools. Histogram rows for a vdev are
+ * contiguous: latency row (v * LAT_TYPES + t) holds latency type t of
+ * vdev v. The arrays are only grown, never shrunk, so once the largest
+ * configuration has been seen, collecting does not allocate.
  *
+ * The printers then render one metric family at a time over all vdevs,
+ * which keeps each family contiguous in the output, as prometheus expects.
+ *
+ * When streaming, the snapshot is a window of at most sn_vdev_limit vdevs.
+ * Each time the window fills up, it is rendered for the current family
+ * (sn_group, sn_family) and reused, see print_stream().
  */
-char *
-get_vdev_name(nvlist_t *nvroot, const char *parent_name) {
-	static char vdev_name[256];
-	char *vdev_type = NULL;
-	uint64_t vdev_id = 0;
+typedef struct snapshot {
+	uint_t		sn_collect;		/* bitmask of family groups */
+	uint_t		sn_vdev_limit;		/* 0 = no limit */
+	family_group_t	sn_group;
+	int		sn_family;
+	double		sn_now;			/* monotonic, in seconds */
 
-	if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE,
-	    &vdev_type) != 0) {
-		vdev_type = "unknown";
+	/* per pool */
+	uint_t		sn_npools;
+	uint_t		sn_pools_alloc;
+	char		**sn_pool_name;		/* escaped for labels */
+	zpool_handle_t	**sn_zhp;		/* held open while streaming */
+	int		*sn_pool_depth;		/* deepest vdevs walked, */
+						/* -1 for none */
+	nvlist_t	**sn_nvroot;
+	boolean_t	*sn_has_scan;
+	const char	**sn_scan_state;
+	double		*sn_scan_val;		/* SCAN_METRICS per pool */
+	boolean_t	*sn_has_ddt;
+	uint64_t	*sn_ddt;		/* DDT_VALUES per pool, the */
+						/* histogram cumulated */
+	uint_t		*sn_class_mask;		/* classes present */
+	uint64_t	*sn_class_space;	/* CLASS_SPACE per class */
+	uint64_t	*sn_class_lat;		/* LAT_TYPES rows per class, */
+						/* cumulated */
+
+	/* per vdev */
+	uint_t		sn_nvdevs;
+	uint_t		sn_vdevs_alloc;
+	uint_t		*sn_pool;		/* index into the per pool arrays */
+	uint_t		*sn_depth;		/* 0 = root */
+	uint_t		*sn_groups;		/* family groups collected */
+	char		**sn_desc;		/* see get_vdev_desc() */
+	const char	**sn_state_name;
+	boolean_t	*sn_has_ex;		/* extended stats are valid */
+	uint64_t	*sn_vs[VS_COLUMNS];
+	uint64_t	*sn_leaf;		/* LEAF_FIELDS values per vdev */
+	uint64_t	*sn_leaf_mask;		/* leaf fields present, 0 if */
+						/* not a leaf */
+	double		*sn_rate;		/* PROGRESS_TYPES per vdev, */
+						/* < 0 if unknown */
+	uint64_t	*sn_lat;		/* LAT_TYPES rows per vdev */
+	uint64_t	*sn_size;		/* SIZE_TYPES rows per vdev */
+	uint64_t	*sn_queue;		/* QUEUE_TYPES values per vdev */
+
+	arena_t		sn_arena;		/* strings */
+	arena_mark_t	sn_mark;		/* start of the vdev strings */
+} snapshot_t;
+
+#define	CLASS_LAT_ROW(sn, p, k, t)	(&(sn)->sn_class_lat[(((p) * \
+	VDEV_CLASSES + (k)) * LAT_TYPES + (t)) * VDEV_L_HISTO_BUCKETS])
+#define	LAT_ROW(sn, v, t)	(&(sn)->sn_lat[((v) * LAT_TYPES + (t)) * \
+				    VDEV_L_HISTO_BUCKETS])
+#define	SIZE_ROW(sn, v, t)	(&(sn)->sn_size[((v) * SIZE_TYPES + (t)) * \
+				    VDEV_RQ_HISTO_BUCKETS])
+
+snapshot_t snap = { .sn_collect = FG_ALL };
+boolean_t stream_output = B_FALSE;
+time_t config_time = 0;		/* of the last zpool_iter(), 0 = never */
+uint64_t heap_allocs = 0;	/* calls to xrealloc(), ever */
+
+void print_family(snapshot_t *, family_group_t, int);
+
+/*
+ * realloc or die trying
+ */
+void *
+xrealloc(void *ptr, size_t size) {
+	void *p = realloc(ptr, size);
+
+	/* the event thread allocates too */
+	(void) __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+	if (p == NULL) {
+		fprintf(stderr, "error: cannot allocate memory\n");
+		exit(1);
 	}
-	if (nvlist_lookup_uint64(
-	    nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
-		vdev_id = -1ULL;
+	return (p);
+}
+
+/*
+ * formatted strdup, or die trying
+ */
+char *
+xasprintf(const char *fmt, ...) {
+	va_list ap;
+	char *s;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	s = xrealloc(NULL, len + 1);
+	va_start(ap, fmt);
+	(void) vsnprintf(s, len + 1, fmt, ap);
+	va_end(ap);
+	return (s);
+}
+
+arena_chunk_t *
+arena_chunk_alloc(size_t size) {
+	arena_chunk_t *ac;
+
+	if (size < ARENA_CHUNK)
+		size = ARENA_CHUNK;
+	ac = xrealloc(NULL, sizeof (arena_chunk_t) + size);
+	ac->ac_next = NULL;
+	ac->ac_size = size;
+	ac->ac_used = 0;
+	return (ac);
+}
+
+char *
+arena_alloc(arena_t *a, size_t len) {
+	char *s;
+
+	if (a->a_cur == NULL)
+		a->a_first = a->a_cur = arena_chunk_alloc(len);
+	while (a->a_cur->ac_used + len > a->a_cur->ac_size) {
+		if (a->a_cur->ac_next == NULL)
+			a->a_cur->ac_next = arena_chunk_alloc(len);
+		a->a_cur = a->a_cur->ac_next;
+		a->a_cur->ac_used = 0;
 	}
-	if (parent_name == NULL) {
-		(void) snprintf(vdev_name, sizeof(vdev_name), "%s",
-		    vdev_type);
+	s = &a->a_cur->ac_data[a->a_cur->ac_used];
+	a->a_cur->ac_used += len;
+	a->a_allocs++;
+	return (s);
+}
+
+char *
+arena_strdup(arena_t *a, const char *str) {
+	size_t len = strlen(str) + 1;
+
+	return (memcpy(arena_alloc(a, len), str, len));
+}
+
+/*
+ * mark and release return the arena to an earlier state, keeping the
+ * chunks for reuse
+ */
+void
+arena_mark(arena_t *a, arena_mark_t *am) {
+	am->am_chunk = a->a_cur;
+	am->am_used = a->a_cur != NULL ? a->a_cur->ac_used : 0;
+}
+
+void
+arena_release(arena_t *a, arena_mark_t *am) {
+	if (am->am_chunk == NULL) {
+		a->a_cur = a->a_first;
+		am->am_used = 0;
 	} else {
-		(void) snprintf(vdev_name, sizeof(vdev_name),
-		    "%s/%s-%lu",
-		    parent_name, vdev_type, vdev_id);
+		a->a_cur = am->am_chunk;
+	}
+	if (a->a_cur != NULL)
+		a->a_cur->ac_used = am->am_used;
+}
+
+void
+arena_reset(arena_t *a) {
+	arena_chunk_t *ac, *next;
+	size_t size = 0;
+
+	if (a->a_first == NULL)
+		return;
+	if (a->a_first->ac_next != NULL) {
+		for (ac = a->a_first; ac != NULL; ac = next) {
+			next = ac->ac_next;
+			size += ac->ac_size;
+			free(ac);
+		}
+		a->a_first = arena_chunk_alloc(size);
+	}
+	a->a_first->ac_used = 0;
+	a->a_cur = a->a_first;
+}
+
+size_t
+arena_bytes(arena_t *a) {
+	size_t size = 0;
+
+	for (arena_chunk_t *ac = a->a_first; ac != NULL; ac = ac->ac_next)
+		size += sizeof (arena_chunk_t) + ac->ac_size;
+	return (size);
+}
+
+void
+init_histo_family(histo_names_t *hn, char *prefix, char *name, char *unit) {
+	hn->family = xasprintf("%s_%s_%s", prefix, name, unit);
+	hn->bucket = xasprintf("%s_bucket", hn->family);
+	hn->sum = xasprintf("%s_sum", hn->family);
+	hn->count = xasprintf("%s_count", hn->family);
+}
+
+/*
+ * Latency buckets are powers of 2 nanoseconds, expressed in seconds.
+ * These are formatted from integers so that they are exact: a power of 2
+ * is never a multiple of 10, so there are no trailing zeros to trim.
+ */
+void
+init_histo_names(void) {
+	uint64_t ns;
+
+	for (int i = 0; i < LAT_TYPES; i++)
+		init_histo_family(&lat_names[i], POOL_LATENCY_MEASUREMENT,
+		    lat_type[i].name, "seconds");
+	for (int i = 0; i < SIZE_TYPES; i++)
+		init_histo_family(&size_names[i], POOL_IO_SIZE_MEASUREMENT,
+		    size_type[i].short_name, "bytes");
+
+	for (int j = 0; j < VDEV_L_HISTO_BUCKETS; j++) {
+		ns = 1ULL << j;
+		lat_le[j] = xasprintf(",le=\"%"PRIu64".%09"PRIu64"\"} ",
+		    ns / 1000000000, ns % 1000000000);
+	}
+	for (int j = 0; j < VDEV_RQ_HISTO_BUCKETS; j++)
+		size_le[j] = xasprintf(",le=\"%"PRIu64"\"} ", 1ULL << j);
+
+	for (int i = 0; i < LAT_TYPES; i++)
+		init_histo_family(&class_lat_names[i], CLASS_MEASUREMENT
+		    "_latency", lat_type[i].short_name, "seconds");
+	for (int k = VC_NORMAL; k < VDEV_CLASSES; k++)
+		class_desc[k] = xasprintf("class=\"%s\"", vdev_class_name[k]);
+
+	/* references are integers, bucket j ends at 2^(j+1) - 1 */
+	for (int j = 0; j < DDT_HISTO_BUCKETS; j++)
+		ddt_le[j] = xasprintf(",le=\"%"PRIu64"\"} ",
+		    (1ULL << (j + 1)) - 1);
+}
+
+/*
+ * fill in the family descriptors, after init_histo_names()
+ */
+void
+init_families(void) {
+	family_desc_t *fd;
+	vs_column_t c;
+
+	for (int g = 0; g < FG_GROUPS; g++) {
+		family_base[g] = nfamilies;
+		nfamilies += family_count[g];
+	}
+	families = xrealloc(NULL, nfamilies * sizeof (family_desc_t));
+	for (int g = 0; g < FG_GROUPS; g++) {
+		for (int i = 0; i < family_count[g]; i++) {
+			fd = &families[FAMILY_ID(g, i)];
+			switch (g) {
+				case FG_SUMMARY:
+					fd->fd_name = xasprintf("%s_%s",
+					    POOL_MEASUREMENT,
+					    vs_column_desc[i].name);
+					fd->fd_help = vs_column_desc[i].help;
+					fd->fd_type = vs_column_desc[i].type;
+					break;
+				case FG_LEAF:
+					fd->fd_name = xasprintf("%s_%s",
+					    POOL_MEASUREMENT,
+					    leaf_field_desc[i].name);
+					fd->fd_help = leaf_field_desc[i].help;
+					fd->fd_type = leaf_field_desc[i].type;
+					break;
+				case FG_PROGRESS:
+					fd->fd_name = xasprintf("%s_%s",
+					    POOL_MEASUREMENT,
+					    progress_desc[i].name);
+					fd->fd_help = progress_desc[i].help;
+					fd->fd_type = "gauge";
+					break;
+				case FG_LATENCY:
+					fd->fd_name = lat_names[i].family;
+					fd->fd_help = "latency distribution";
+					fd->fd_type = "histogram";
+					break;
+				case FG_SIZE:
+					fd->fd_name = size_names[i].family;
+					fd->fd_help =
+					    "I/O request size distribution";
+					fd->fd_type = "histogram";
+					break;
+				case FG_QUEUE:
+					fd->fd_name = xasprintf("%s_%s",
+					    POOL_QUEUE_MEASUREMENT,
+					    queue_type[i].short_name);
+					fd->fd_help = "queue depth";
+					fd->fd_type = "gauge";
+					break;
+				case FG_SCAN:
+					fd->fd_name = xasprintf("%s_%s",
+					    SCAN_MEASUREMENT,
+					    scan_metric_desc[i].name);
+					fd->fd_help = scan_metric_desc[i].help;
+					fd->fd_type = scan_metric_desc[i].type;
+					break;
+				case FG_DDT:
+					fd->fd_name = xasprintf("%s_%s",
+					    DDT_MEASUREMENT,
+					    ddt_metric_desc[i].name);
+					fd->fd_help = ddt_metric_desc[i].help;
+					fd->fd_type = ddt_metric_desc[i].type;
+					break;
+				case FG_CLASS:
+					if (i >= CLASS_SPACE) {
+						fd->fd_name = class_lat_names[
+						    i - CLASS_SPACE].family;
+						fd->fd_help = "latency "
+						    "distribution per class";
+						fd->fd_type = "histogram";
+						break;
+					}
+					c = class_space_column[i];
+					fd->fd_name = xasprintf("%s_%s",
+					    CLASS_MEASUREMENT,
+					    vs_column_desc[c].name);
+					fd->fd_help = vs_column_desc[c].help;
+					fd->fd_type = "gauge";
+					break;
+				default:
+					break;
+			}
+		}
+	}
+}
+
+/*
+ * add patterns, in a comma separated list, to a filter
+ */
+void
+family_filter_add(family_filter_t *ff, boolean_t include, char *list) {
+	char *pattern, *last;
+	char ***patterns = include ? &ff->ff_include : &ff->ff_exclude;
+	uint_t *n = include ? &ff->ff_ninclude : &ff->ff_nexclude;
+
+	for (pattern = strtok_r(list, ",", &last); pattern != NULL;
+	    pattern = strtok_r(NULL, ",", &last)) {
+		*patterns = xrealloc(*patterns, (*n + 1) * sizeof (char *));
+		(*patterns)[(*n)++] = pattern;
+	}
+}
+
+/*
+ * Read a filter file, with an "include <pattern>" or "exclude <pattern>"
+ * per line. Blank lines and lines starting with # are ignored.
+ */
+int
+family_filter_load(family_filter_t *ff, char *path) {
+	FILE *fp;
+	char line[256], *kind, *pattern, *last;
+	int lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "error: cannot open %s: %s\n", path,
+		    strerror(errno));
+		return (-1);
+	}
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		lineno++;
+		if ((kind = strtok_r(line, " \t\n", &last)) == NULL ||
+		    *kind == '#')
+			continue;
+		pattern = strtok_r(NULL, " \t\n", &last);
+		if (pattern == NULL || strtok_r(NULL, " \t\n", &last) != NULL ||
+		    (strcmp(kind, "include") != 0 &&
+		    strcmp(kind, "exclude") != 0)) {
+			fprintf(stderr, "error: %s:%d: expected include or "
+			    "exclude and a pattern\n", path, lineno);
+			(void) fclose(fp);
+			return (-1);
+		}
+		family_filter_add(ff, strcmp(kind, "include") == 0,
+		    xasprintf("%s", pattern));
+	}
+	(void) fclose(fp);
+	return (0);
+}
+
+/*
+ * an empty set, once the families are known
+ */
+void
+family_set_init(family_set_t *fs) {
+	fs->fs_bits = xrealloc(NULL, family_words * sizeof (uint64_t));
+	(void) memset(fs->fs_bits, 0, family_words * sizeof (uint64_t));
+	fs->fs_groups = 0;
+	fs->fs_kgroups = 0;
+}
+
+void
+family_set_copy(family_set_t *to, family_set_t *from) {
+	(void) memcpy(to->fs_bits, from->fs_bits,
+	    family_words * sizeof (uint64_t));
+	to->fs_groups = from->fs_groups;
+	to->fs_kgroups = from->fs_kgroups;
+}
+
+void
+family_set_union(family_set_t *to, family_set_t *from) {
+	for (int w = 0; w < family_words; w++)
+		to->fs_bits[w] |= from->fs_bits[w];
+	to->fs_groups |= from->fs_groups;
+	to->fs_kgroups |= from->fs_kgroups;
+}
+
+/*
+ * the groups with a family in the set
+ */
+void
+family_set_groups(family_set_t *fs) {
+	fs->fs_groups = 0;
+	for (int g = 0; g < FG_GROUPS; g++) {
+		for (int i = 0; i < family_count[g]; i++) {
+			if (FAMILY_IN(fs, FAMILY_ID(g, i))) {
+				fs->fs_groups |= 1 << g;
+				break;
+			}
+		}
+	}
+	fs->fs_kgroups = 0;
+	for (int k = 0; k < KG_GROUPS; k++) {
+		for (int i = 0; i < family_kcount[k]; i++) {
+			if (FAMILY_IN(fs, KFAMILY_ID(k, i))) {
+				fs->fs_kgroups |= 1 << k;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * A family is in the set if it matches an include pattern, or there are
+ * none, and matches no exclude pattern. The set is from
+ * family_set_init(). Returns the number of families in the set.
+ */
+uint_t
+family_set_compile(family_set_t *fs, family_filter_t *ff) {
+	uint_t n = 0;
+	boolean_t in;
+
+	(void) memset(fs->fs_bits, 0, family_words * sizeof (uint64_t));
+	for (uint_t id = 0; id < nfamilies; id++) {
+		in = ff->ff_ninclude == 0;
+		for (uint_t p = 0; !in && p < ff->ff_ninclude; p++)
+			in = fnmatch(ff->ff_include[p],
+			    families[id].fd_name, 0) == 0;
+		for (uint_t p = 0; in && p < ff->ff_nexclude; p++)
+			in = fnmatch(ff->ff_exclude[p],
+			    families[id].fd_name, 0) != 0;
+		if (!in)
+			continue;
+		fs->fs_bits[id / 64] |= 1ULL << (id % 64);
+		n++;
+	}
+	family_set_groups(fs);
+	return (n);
+}
+
+boolean_t
+family_set_subset(family_set_t *a, family_set_t *b) {
+	for (int w = 0; w < family_words; w++) {
+		if (a->fs_bits[w] & ~b->fs_bits[w])
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * The families for a scrape line, a space separated list of include
+ * patterns, within the configured ones. An empty line is the configured
+ * set. The sets of recent lines are kept, so a scraper repeating the
+ * same request costs a string compare.
+ */
+family_set_t *
+scrape_filter_lookup(char *line) {
+	scrape_filter_t *sf;
+	family_filter_t ff = { 0 };
+	char copy[SCRAPE_LINE_MAX], *pattern, *last;
+	char *include[SCRAPE_LINE_MAX / 2];
+
+	if (strspn(line, " \t") == strlen(line))
+		return (&family_config);
+	for (uint_t i = 0; i < scrape_nfilters; i++) {
+		if (strcmp(scrape_filters[i].sf_line, line) == 0)
+			return (&scrape_filters[i].sf_set);
+	}
+
+	(void) strcpy(copy, line);
+	ff.ff_include = include;
+	for (pattern = strtok_r(copy, " \t", &last); pattern != NULL;
+	    pattern = strtok_r(NULL, " \t", &last))
+		include[ff.ff_ninclude++] = pattern;
+
+	sf = &scrape_filters[scrape_next];
+	scrape_next = (scrape_next + 1) % SCRAPE_FILTERS;
+	if (scrape_nfilters < SCRAPE_FILTERS) {
+		family_set_init(&sf->sf_set);
+		scrape_nfilters++;
+	}
+	(void) strcpy(sf->sf_line, line);
+	(void) family_set_compile(&sf->sf_set, &ff);
+	for (int w = 0; w < family_words; w++)
+		sf->sf_set.fs_bits[w] &= family_config.fs_bits[w];
+	family_set_groups(&sf->sf_set);
+	return (&sf->sf_set);
+}
+
+/*
+ * though the prometheus docs don't seem to mention how to handle strange
+ * characters for labels, we'll try a conservative approach and filter as if
+ * the pool name is an unknowable string.
+ *
+ * the result lives in the arena, until it is reset
+ */
+char *
+escape_string(arena_t *a, char *s) {
+	char *c, *d;
+	char *t = arena_alloc(a, 2 * strlen(s) + 1);
+
+	for (c = s, d = t; *c != '\0'; c++, d++) {
+		switch (*c) {
+			case '"':
+			case '\\':
+				*d++ = '\\';
+			default:
+				*d = *c;
+		}
+	}
+	*d = '\0';
+	return (t);
+}
+
+/*
+ * escaped copy on the heap, for labels kept between collections
+ */
+char *
+escape_label(char *s) {
+	arena_mark_t m;
+	char *t;
+
+	arena_mark(&snap.sn_arena, &m);
+	t = xasprintf("%s", escape_string(&snap.sn_arena, s));
+	arena_release(&snap.sn_arena, &m);
+	return (t);
+}
+
+/*
+ * print help or type values for a given metric name. Each metric family
+ * is printed contiguously, so this is called once per family.
+ */
+void
+print_help_type(char *metric_name, char *help, char *type) {
+	if (help != NULL)
+		(void) printf("# HELP %s %s\n", metric_name, help);
+	if (type != NULL)
+		(void) printf("# TYPE %s %s\n", metric_name, type);
+}
+
+/*
+ * As of early 2019, prometheus only has a float64 data type.
+ * This is unfortunate because ZFS uses mostly uint64 data type.
+ * For high-speed systems or slow-speed systems that have been up
+ * for a long time, these counters will overflow the significand,
+ * causing queries that take derivatives or differences to seemingly
+ * fail. Since most of these counters are only counting up, we can
+ * mask them to fit in the significand and reset to zero when full.
+ * Queries that then use non-negative derivatives (a best practice)
+ * will handle it nicely.
+ */
+#define SIGNIFICANT_BITS 52
+#define	SIGNIFICAND_MASK	((uint64_t)((1ULL << SIGNIFICANT_BITS) - 1))
+
+void
+print_prom_u64(char *prefix, char *metric, char *label, uint64_t value,
+               char *help, char *type) {
+	char metric_name[200];
+	uint64_t mask = SIGNIFICAND_MASK;
+
+	(void) snprintf(metric_name, sizeof(metric_name), "%s_%s", prefix,
+	    metric);
+	print_help_type(metric_name, help, type);
+	if (label != NULL)
+		(void) printf("%s{%s} %"PRIu64"\n", metric_name, label,
+		    value & mask);
+	else
+		(void) printf("%s %"PRIu64"\n", metric_name, value & mask);
+}
+
+/*
+ * doubles are native data type for prometheus, send them through unimpeded
+ */
+void
+print_prom_d(char *prefix, char *metric, char *label, double value,
+             char *help, char *type) {
+	char metric_name[200];
+	(void) snprintf(metric_name, sizeof(metric_name), "%s_%s", prefix,
+	    metric);
+	print_help_type(metric_name, help, type);
+	if (label != NULL)
+		(void) printf("%s{%s} %f\n", metric_name, label, value);
+	else
+		(void) printf("%s %f\n", metric_name, value);
+}
+
+/*
+ * print a sample from precomputed pieces, avoiding printf in the
+ * histogram loops:
+ *	<metric>{name="<pool>",<vdev_desc><le><value>
+ */
+void
+print_value_u64(uint64_t value) {
+	char buf[24];
+	char *c = &buf[sizeof (buf)];
+
+	value &= SIGNIFICAND_MASK;
+	*--c = '\n';
+	do {
+		*--c = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	(void) fwrite(c, 1, &buf[sizeof (buf)] - c, stdout);
+}
+
+void
+print_histo_sample(char *metric, char *pool_name, char *vdev_desc, char *le,
+                   uint64_t value) {
+	(void) fputs(metric, stdout);
+	(void) fputs("{name=\"", stdout);
+	(void) fputs(pool_name, stdout);
+	(void) fputs("\",", stdout);
+	(void) fputs(vdev_desc, stdout);
+	(void) fputs(le, stdout);
+	print_value_u64(value);
+}
+
+scan_rate_t *
+scan_rate_lookup(char *pool_label) {
+	scan_rate_t *sr;
+
+	for (uint_t i = 0; i < scan_nrates; i++) {
+		if (strcmp(scan_rates[i].sr_pool, pool_label) == 0)
+			return (&scan_rates[i]);
+	}
+	scan_rates = xrealloc(scan_rates,
+	    (scan_nrates + 1) * sizeof (scan_rate_t));
+	sr = &scan_rates[scan_nrates++];
+	(void) memset(sr, 0, sizeof (*sr));
+	sr->sr_pool = xasprintf("%s", pool_label);
+	return (sr);
+}
+
+/*
+ * forget the rates of pools that are gone, after a config refresh
+ */
+void
+scan_rates_prune(snapshot_t *sn) {
+	uint_t i, p, n = 0;
+
+	for (i = 0; i < scan_nrates; i++) {
+		for (p = 0; p < sn->sn_npools; p++) {
+			if (strcmp(scan_rates[i].sr_pool,
+			    sn->sn_pool_name[p]) == 0)
+				break;
+		}
+		if (p == sn->sn_npools) {
+			free(scan_rates[i].sr_pool);
+			continue;
+		}
+		scan_rates[n++] = scan_rates[i];
+	}
+	scan_nrates = n;
+}
+
+/*
+ * fold a sample of a running scan into its rates
+ */
+void
+scan_rate_update(scan_rate_t *sr, pool_scan_stat_t *ps, double now,
+                 double elapsed, boolean_t paused) {
+	double dt = now - sr->sr_time, alpha;
+
+	if (sr->sr_time == 0 || sr->sr_start != ps->pss_start_time ||
+	    ps->pss_examined < sr->sr_examined ||
+	    PSS_ISSUED(ps) < sr->sr_issued) {
+		/* a new scan, or the first sample of it */
+		sr->sr_start = ps->pss_start_time;
+		sr->sr_examine_rate = ps->pss_pass_exam / elapsed;
+		sr->sr_issue_rate = PSS_PASS_ISSUED(ps) / elapsed;
+	} else if (dt > 0 && !paused) {
+		alpha = dt / (SCAN_RATE_TAU + dt);
+		sr->sr_examine_rate += alpha *
+		    ((ps->pss_examined - sr->sr_examined) / dt -
+		    sr->sr_examine_rate);
+		sr->sr_issue_rate += alpha *
+		    ((PSS_ISSUED(ps) - sr->sr_issued) / dt -
+		    sr->sr_issue_rate);
+	} else if (paused) {
+		sr->sr_examine_rate = 0;
+		sr->sr_issue_rate = 0;
+	}
+	sr->sr_time = now;
+	sr->sr_examined = ps->pss_examined;
+	sr->sr_issued = PSS_ISSUED(ps);
+}
+
+/*
+ * collect_scan_status() gathers the details as often seen in the
+ * "zpool status" output. However, unlike the zpool command, which is
+ * intended for humans, this output is suitable for long-term tracking in
+ * prometheus.
+ */
+int
+collect_scan_status(snapshot_t *sn, uint_t pool, pool_scan_stat_t *ps) {
+	int64_t elapsed;
+	uint64_t examined, pass_exam, paused_time, paused_ts, left;
+	double pct_done, rate, remaining_time;
+	scan_rate_t *sr;
+	double *val = &sn->sn_scan_val[pool * SCAN_METRICS];
+	char *state[DSS_NUM_STATES] = {"none", "scanning", "finished",
+	                               "canceled"};
+	char *func = "unknown_function";
+
+	/*
+	 * ignore if there are no stats or state is bogus
+	 */
+	if (ps == NULL || ps->pss_state >= DSS_NUM_STATES ||
+	    ps->pss_func >= POOL_SCAN_FUNCS)
+		return (0);
+
+	switch (ps->pss_func) {
+		case POOL_SCAN_NONE:
+			func = "none_requested";
+			break;
+		case POOL_SCAN_SCRUB:
+			func = "scrub";
+			break;
+		case POOL_SCAN_RESILVER:
+			func = "resilver";
+			break;
+#ifdef POOL_SCAN_REBUILD
+		case POOL_SCAN_REBUILD:
+				func = "rebuild";
+				break;
+#endif
+		default:
+			func = "scan";
+	}
+
+	/* overall progress */
+	examined = ps->pss_examined;
+	pct_done = 0.0;
+	if (ps->pss_to_examine > 0)
+		pct_done = 100.0 * examined / ps->pss_to_examine;
+
+#ifdef EZFS_SCRUB_PAUSED
+	paused_ts = ps->pss_pass_scrub_pause;
+	paused_time = ps->pss_pass_scrub_spent_paused;
+#else
+	paused_ts = 0;
+	paused_time = 0;
+#endif
+
+	/* this pass */
+	if (ps->pss_state == DSS_SCANNING)
+		elapsed = time(NULL) - ps->pss_pass_start - paused_time;
+	else
+		elapsed = ps->pss_end_time - ps->pss_pass_start - paused_time;
+	elapsed = (elapsed > 0) ? elapsed : 1;
+	pass_exam = ps->pss_pass_exam;
+
+	sr = scan_rate_lookup(sn->sn_pool_name[pool]);
+	if (ps->pss_state == DSS_SCANNING) {
+		scan_rate_update(sr, ps, sn->sn_now, (double)elapsed,
+		    paused_ts != 0);
+		/*
+		 * With sequential scans, the scan is done when all of the
+		 * examined bytes have been issued, so use the issue rate.
+		 */
+		if (PSS_ISSUED(ps) != 0 || PSS_PASS_ISSUED(ps) != 0) {
+			left = ps->pss_to_examine > PSS_ISSUED(ps) ?
+			    ps->pss_to_examine - PSS_ISSUED(ps) : 0;
+			rate = sr->sr_issue_rate;
+		} else {
+			left = ps->pss_to_examine > examined ?
+			    ps->pss_to_examine - examined : 0;
+			rate = sr->sr_examine_rate;
+		}
+		remaining_time = rate > 0 ? left / rate : NAN;
+	} else {
+		/* the rates of the pass, as it ended */
+		sr->sr_time = 0;
+		sr->sr_examine_rate = (double)pass_exam / elapsed;
+		sr->sr_issue_rate = (double)PSS_PASS_ISSUED(ps) / elapsed;
+		remaining_time = 0;
+	}
+
+	sn->sn_scan_state[pool] = state[ps->pss_state];
+	val[SCAN_START_TS] = ps->pss_start_time & SIGNIFICAND_MASK;
+	val[SCAN_END_TS] = ps->pss_end_time & SIGNIFICAND_MASK;
+	val[SCAN_PAUSE_TS] = paused_ts & SIGNIFICAND_MASK;
+	val[SCAN_PAUSED] = paused_time & SIGNIFICAND_MASK;
+	val[SCAN_REMAINING_TIME] = remaining_time;
+	val[SCAN_ERRORS] = ps->pss_errors & SIGNIFICAND_MASK;
+	val[SCAN_EXAMINED] = examined & SIGNIFICAND_MASK;
+	val[SCAN_EXAMINED_PASS] = pass_exam & SIGNIFICAND_MASK;
+	val[SCAN_PCT_DONE] = pct_done;
+	val[SCAN_PROCESSED] = ps->pss_processed & SIGNIFICAND_MASK;
+	val[SCAN_RATE] = sr->sr_examine_rate;
+	val[SCAN_TO_EXAMINE] = ps->pss_to_examine & SIGNIFICAND_MASK;
+	val[SCAN_TO_PROCESS] = ps->pss_to_process & SIGNIFICAND_MASK;
+	val[SCAN_ISSUED] = PSS_ISSUED(ps) & SIGNIFICAND_MASK;
+	val[SCAN_ISSUED_RATE] = sr->sr_issue_rate;
+	sn->sn_has_scan[pool] = B_TRUE;
+
+	return (0);
+}
+
+/*
+ *
+ */
+char *
+get_vdev_name(nvlist_t *nvroot, const char *parent_name) {
+	static char vdev_name[256];
+	char *vdev_type = NULL;
+	uint64_t vdev_id = 0;
+
+	if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE,
+	    &vdev_type) != 0) {
+		vdev_type = "unknown";
+	}
+	if (nvlist_lookup_uint64(
+	    nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
+		vdev_id = -1ULL;
+	}
+	if (parent_name == NULL) {
+		(void) snprintf(vdev_name, sizeof(vdev_name), "%s",
+		    vdev_type);
+	} else {
+		(void) snprintf(vdev_name, sizeof(vdev_name),
+		    "%s/%s-%lu",
+		    parent_name, vdev_type, vdev_id);
+	}
+	return (vdev_name);
+}
+
+/*
+ * Device paths change across reboots, the names in /dev/disk/by-id do
+ * not. The by-id links are resolved into a map from device to name once,
+ * sorted for bsearch(), and only resolved again when inotify reports a
+ * change in the directory. Vdev paths that are links themselves, such as
+ * in /dev/mapper, are resolved the first time they are looked up, and
+ * the result, even none, is added to the map until it is loaded again.
+ * Of several names for a device, the first in sort order is used.
+ */
+typedef struct byid_entry {
+	char	*be_dev;		/* resolved link, or vdev path */
+	char	*be_name;		/* NULL if the path has none */
+} byid_entry_t;
+
+byid_entry_t *byid_map = NULL;
+uint_t byid_count = 0;
+int byid_fd = -1;
+boolean_t byid_watched = B_FALSE;
+
+int
+byid_compare(const void *a, const void *b) {
+	const byid_entry_t *ea = a, *eb = b;
+	int c = strcmp(ea->be_dev, eb->be_dev);
+
+	return (c != 0 ? c : strcmp(ea->be_name, eb->be_name));
+}
+
+int
+byid_dev_compare(const void *a, const void *b) {
+	return (strcmp(((const byid_entry_t *)a)->be_dev,
+	    ((const byid_entry_t *)b)->be_dev));
+}
+
+void
+byid_load(void) {
+	DIR *dir;
+	struct dirent *de;
+	char link[PATH_MAX], dev[PATH_MAX];
+	uint_t i, n;
+
+	for (i = 0; i < byid_count; i++) {
+		free(byid_map[i].be_dev);
+		free(byid_map[i].be_name);
+	}
+	byid_count = 0;
+	if ((dir = opendir(BYID_DIR)) == NULL)
+		return;
+	for (n = 0; (de = readdir(dir)) != NULL; ) {
+		if (de->d_name[0] == '.')
+			continue;
+		(void) snprintf(link, sizeof (link), BYID_DIR "/%s",
+		    de->d_name);
+		if (realpath(link, dev) == NULL)
+			continue;
+		if (byid_count == n) {
+			n = n ? n << 1 : 64;
+			byid_map = xrealloc(byid_map, n * sizeof (byid_entry_t));
+		}
+		byid_map[byid_count].be_dev = xasprintf("%s", dev);
+		byid_map[byid_count].be_name = xasprintf("%s", de->d_name);
+		byid_count++;
+	}
+	(void) closedir(dir);
+	qsort(byid_map, byid_count, sizeof (byid_entry_t), byid_compare);
+
+	/* keep the first name of each device */
+	for (i = n = 0; i < byid_count; i++) {
+		if (n > 0 && strcmp(byid_map[n - 1].be_dev,
+		    byid_map[i].be_dev) == 0) {
+			free(byid_map[i].be_dev);
+			free(byid_map[i].be_name);
+			continue;
+		}
+		byid_map[n++] = byid_map[i];
+	}
+	byid_count = n;
+}
+
+/*
+ * before each config collection: reload the map if the directory changed,
+ * or until it can be watched, such as before udev has created it
+ */
+void
+byid_refresh(void) {
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	boolean_t changed = !byid_watched;
+	ssize_t n;
+
+	if (byid_fd < 0 &&
+	    (byid_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return;
+	if (!byid_watched)
+		byid_watched = inotify_add_watch(byid_fd, BYID_DIR, IN_CREATE |
+		    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF) >= 0;
+	while ((n = read(byid_fd, buf, sizeof (buf))) > 0) {
+		changed = B_TRUE;
+		for (char *p = buf; p < buf + n; p += sizeof (*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			/* the directory is gone, watch it again when back */
+			if (ev->mask & IN_IGNORED)
+				byid_watched = B_FALSE;
+		}
+	}
+	if (changed)
+		byid_load();
+}
+
+char *
+byid_lookup(char *path) {
+	byid_entry_t key, *e;
+	char dev[PATH_MAX], *name = NULL;
+	uint_t i;
+
+	if (strncmp(path, BYID_DIR "/", sizeof (BYID_DIR)) == 0)
+		return (path + sizeof (BYID_DIR));
+	key.be_dev = path;
+	e = bsearch(&key, byid_map, byid_count, sizeof (byid_entry_t),
+	    byid_dev_compare);
+	if (e != NULL)
+		return (e->be_name);
+	if (realpath(path, dev) != NULL && strcmp(dev, path) != 0) {
+		key.be_dev = dev;
+		e = bsearch(&key, byid_map, byid_count, sizeof (byid_entry_t),
+		    byid_dev_compare);
+		if (e != NULL)
+			name = xasprintf("%s", e->be_name);
+	}
+
+	/* so that the path is resolved once per load */
+	byid_map = xrealloc(byid_map, (byid_count + 1) * sizeof (byid_entry_t));
+	for (i = byid_count; i > 0 && strcmp(byid_map[i - 1].be_dev, path) > 0;
+	    i--)
+		byid_map[i] = byid_map[i - 1];
+	byid_map[i].be_dev = xasprintf("%s", path);
+	byid_map[i].be_name = name;
+	byid_count++;
+	return (name);
+}
+
+/*
+ * Append a label to a vdev description of len bytes. A label that does
+ * not fit is left out whole, as a truncated one would not be valid.
+ */
+void
+desc_append(char *desc, size_t size, size_t *len, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(desc + *len, size - *len, fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= size - *len)
+		desc[*len] = '\0';
+	else
+		*len += n;
+}
+
+/*
+ * get a string suitable for prometheus label that describes this vdev
+ *
+ * By default only the vdev hierarchical name is shown, separated by '/'
+ * Vdevs other than the root have their allocation class, and all have
+ * their guid, which is stable.
+ * If the vdev has an associated path, which is typical of leaf vdevs,
+ * then the path is added, with its by-id name when there is one, and the
+ * devid and physical path when the config has them. Cache and spare
+ * devices have no id in the config, so their index is given instead.
+ */
+char *
+get_vdev_desc(nvlist_t *nvroot, const char *parent_name, vdev_class_t vc,
+              uint64_t index) {
+	char *vdev_type = NULL;
+	uint64_t vdev_id = 0, vdev_guid = 0;
+	char *vdev_path = NULL, *vdev_devid = NULL, *vdev_phys = NULL;
+	char *vdev_byid = NULL;
+	static char res[VDEV_DESC_MAX];
+	size_t len = 0;
+
+	if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE, &vdev_type) != 0) {
+		vdev_type = "unknown";
+	}
+	if (nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
+		vdev_id = index;
+	}
+	(void) nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_GUID, &vdev_guid);
+	if (nvlist_lookup_string(
+	    nvroot, ZPOOL_CONFIG_PATH, &vdev_path) != 0) {
+		vdev_path = NULL;
+	}
+
+	res[0] = '\0';
+	if (parent_name == NULL) {
+		desc_append(res, sizeof (res), &len, "vdev=\"%s\"",
+		    vdev_type);
+	} else {
+		desc_append(res, sizeof (res), &len,
+		    "vdev=\"%s/%s-%"PRIu64"\"",
+		    parent_name, vdev_type, vdev_id);
+	}
+	if (vc != VC_NONE && LABEL(VL_CLASS))
+		desc_append(res, sizeof (res), &len, ",%s", class_desc[vc]);
+	if (LABEL(VL_GUID))
+		desc_append(res, sizeof (res), &len, ",guid=\"%"PRIu64"\"",
+		    vdev_guid);
+	if (vdev_path == NULL)
+		return (res);
+
+	if (LABEL(VL_PATH))
+		desc_append(res, sizeof (res), &len, ",path=\"%s\"",
+		    vdev_path);
+	if (LABEL(VL_DEVID) && nvlist_lookup_string(nvroot,
+	    ZPOOL_CONFIG_DEVID, &vdev_devid) == 0)
+		desc_append(res, sizeof (res), &len, ",devid=\"%s\"",
+		    vdev_devid);
+	if (LABEL(VL_PHYS_PATH) && nvlist_lookup_string(nvroot,
+	    ZPOOL_CONFIG_PHYS_PATH, &vdev_phys) == 0)
+		desc_append(res, sizeof (res), &len, ",phys_path=\"%s\"",
+		    vdev_phys);
+	if (LABEL(VL_BY_ID) && (vdev_byid = byid_lookup(vdev_path)) != NULL)
+		desc_append(res, sizeof (res), &len, ",by_id=\"%s\"",
+		    vdev_byid);
+	return (res);
+}
+
+
+/*
+ * The kernel keeps histograms as per-bucket counts, but prometheus wants
+ * cumulative buckets. Once a snapshot is collected, every histogram row is
+ * converted in place with a prefix sum. Since all of the rows are in one
+ * array, this is a single batch over all vdevs and all histogram types.
+ *
+ * The vector versions do an in-register scan of 4 (AVX2) or 2 (NEON)
+ * buckets at a time and carry the running total across. The AVX2 version
+ * is selected at runtime so that a generic x86_64 build still benefits.
+ */
+typedef void (*histo_cumulate_f)(uint64_t *, size_t, uint_t);
+
+void
+histo_cumulate_scalar(uint64_t *rows, size_t nrows, uint_t buckets) {
+	uint64_t sum;
+
+	for (size_t r = 0; r < nrows; r++, rows += buckets) {
+		sum = 0;
+		for (uint_t j = 0; j < buckets; j++)
+			rows[j] = sum += rows[j];
+	}
+}
+
+#ifdef HAVE_HISTO_AVX2
+__attribute__((target("avx2")))
+void
+histo_cumulate_avx2(uint64_t *rows, size_t nrows, uint_t buckets) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i x, t, carry;
+	uint64_t sum;
+	uint_t j;
+
+	for (size_t r = 0; r < nrows; r++, rows += buckets) {
+		carry = zero;
+		for (j = 0; j + 4 <= buckets; j += 4) {
+			x = _mm256_loadu_si256((__m256i *) &rows[j]);
+			/* add [0, x0, x1, x2] */
+			t = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0));
+			x = _mm256_add_epi64(x, _mm256_blend_epi32(t, zero, 0x03));
+			/* add [0, 0, x0, x1] */
+			t = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 0, 0));
+			x = _mm256_add_epi64(x, _mm256_blend_epi32(t, zero, 0x0f));
+			x = _mm256_add_epi64(x, carry);
+			_mm256_storeu_si256((__m256i *) &rows[j], x);
+			carry = _mm256_permute4x64_epi64(x,
+			    _MM_SHUFFLE(3, 3, 3, 3));
+		}
+		sum = j ? rows[j - 1] : 0;
+		for (; j < buckets; j++)
+			rows[j] = sum += rows[j];
+	}
+}
+#endif
+
+#ifdef HAVE_HISTO_NEON
+void
+histo_cumulate_neon(uint64_t *rows, size_t nrows, uint_t buckets) {
+	uint64x2_t zero = vdupq_n_u64(0);
+	uint64x2_t x, carry;
+	uint64_t sum;
+	uint_t j;
+
+	for (size_t r = 0; r < nrows; r++, rows += buckets) {
+		carry = zero;
+		for (j = 0; j + 2 <= buckets; j += 2) {
+			x = vld1q_u64(&rows[j]);
+			/* add [0, x0] */
+			x = vaddq_u64(x, vextq_u64(zero, x, 1));
+			x = vaddq_u64(x, carry);
+			vst1q_u64(&rows[j], x);
+			carry = vdupq_laneq_u64(x, 1);
+		}
+		sum = j ? rows[j - 1] : 0;
+		for (; j < buckets; j++)
+			rows[j] = sum += rows[j];
+	}
+}
+#endif
+
+histo_cumulate_f histo_cumulate = histo_cumulate_scalar;
+
+void
+histo_cumulate_init(void) {
+#if defined(HAVE_HISTO_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		histo_cumulate = histo_cumulate_avx2;
+#elif defined(HAVE_HISTO_NEON)
+	histo_cumulate = histo_cumulate_neon;
+#endif
+}
+
+/*
+ * empty the snapshot, keeping the arrays for the next collection
+ */
+void
+snapshot_reset(snapshot_t *sn) {
+	for (uint_t i = 0; i < sn->sn_npools; i++) {
+		if (sn->sn_zhp[i] != NULL)
+			zpool_close(sn->sn_zhp[i]);
+	}
+	sn->sn_npools = 0;
+	sn->sn_nvdevs = 0;
+	arena_reset(&sn->sn_arena);
+}
+
+/*
+ * Memory used per vdev in the snapshot. The vdev description is counted
+ * at the size of the get_vdev_desc() buffer, its upper bound.
+ */
+size_t
+snapshot_vdev_bytes(void) {
+	return (3 * sizeof (uint_t) + 2 * sizeof (char *) + sizeof (boolean_t) +
+	    VS_COLUMNS * sizeof (uint64_t) +
+	    (LEAF_FIELDS + 1) * sizeof (uint64_t) +
+	    PROGRESS_TYPES * sizeof (double) +
+	    LAT_TYPES * VDEV_L_HISTO_BUCKETS * sizeof (uint64_t) +
+	    SIZE_TYPES * VDEV_RQ_HISTO_BUCKETS * sizeof (uint64_t) +
+	    QUEUE_TYPES * sizeof (uint64_t) + VDEV_DESC_MAX);
+}
+
+size_t
+snapshot_bytes(snapshot_t *sn) {
+	return (sn->sn_vdevs_alloc * snapshot_vdev_bytes() +
+	    sn->sn_pools_alloc * (4 * sizeof (void *) + 2 * sizeof (boolean_t) +
+	    SCAN_METRICS * sizeof (double) + DDT_VALUES * sizeof (uint64_t) +
+	    sizeof (uint_t) + sizeof (int) + VDEV_CLASSES * (CLASS_SPACE +
+	    LAT_TYPES * VDEV_L_HISTO_BUCKETS) * sizeof (uint64_t)) +
+	    arena_bytes(&sn->sn_arena));
+}
+
+uint_t
+snapshot_add_pool(snapshot_t *sn, char *pool_name) {
+	uint_t n;
+
+	if (sn->sn_npools == sn->sn_pools_alloc) {
+		n = sn->sn_pools_alloc ? sn->sn_pools_alloc << 1 : 4;
+		sn->sn_pool_name = xrealloc(sn->sn_pool_name,
+		    n * sizeof (char *));
+		sn->sn_zhp = xrealloc(sn->sn_zhp, n * sizeof (zpool_handle_t *));
+		sn->sn_nvroot = xrealloc(sn->sn_nvroot, n * sizeof (nvlist_t *));
+		sn->sn_pool_depth = xrealloc(sn->sn_pool_depth,
+		    n * sizeof (int));
+		sn->sn_scan_state = xrealloc(sn->sn_scan_state,
+		    n * sizeof (char *));
+		sn->sn_scan_val = xrealloc(sn->sn_scan_val,
+		    n * SCAN_METRICS * sizeof (double));
+		sn->sn_has_scan = xrealloc(sn->sn_has_scan,
+		    n * sizeof (boolean_t));
+		sn->sn_has_ddt = xrealloc(sn->sn_has_ddt,
+		    n * sizeof (boolean_t));
+		sn->sn_ddt = xrealloc(sn->sn_ddt,
+		    n * DDT_VALUES * sizeof (uint64_t));
+		sn->sn_class_mask = xrealloc(sn->sn_class_mask,
+		    n * sizeof (uint_t));
+		sn->sn_class_space = xrealloc(sn->sn_class_space,
+		    n * VDEV_CLASSES * CLASS_SPACE * sizeof (uint64_t));
+		sn->sn_class_lat = xrealloc(sn->sn_class_lat, n *
+		    VDEV_CLASSES * LAT_TYPES * VDEV_L_HISTO_BUCKETS *
+		    sizeof (uint64_t));
+		sn->sn_pools_alloc = n;
+	}
+	n = sn->sn_npools++;
+	sn->sn_pool_name[n] = escape_string(&sn->sn_arena, pool_name);
+	sn->sn_zhp[n] = NULL;
+	sn->sn_nvroot[n] = NULL;
+	sn->sn_pool_depth[n] = INT_MAX;
+	sn->sn_has_scan[n] = B_FALSE;
+	sn->sn_has_ddt[n] = B_FALSE;
+	sn->sn_class_mask[n] = 0;
+	return (n);
+}
+
+uint_t
+snapshot_add_vdev(snapshot_t *sn) {
+	uint_t n;
+
+	if (sn->sn_nvdevs == sn->sn_vdevs_alloc) {
+		n = sn->sn_vdevs_alloc ? sn->sn_vdevs_alloc << 1 : 16;
+		if (sn->sn_vdev_limit != 0 && n > sn->sn_vdev_limit)
+			n = sn->sn_vdev_limit;
+		sn->sn_pool = xrealloc(sn->sn_pool, n * sizeof (uint_t));
+		sn->sn_depth = xrealloc(sn->sn_depth, n * sizeof (uint_t));
+		sn->sn_groups = xrealloc(sn->sn_groups, n * sizeof (uint_t));
+		sn->sn_desc = xrealloc(sn->sn_desc, n * sizeof (char *));
+		sn->sn_state_name = xrealloc(sn->sn_state_name,
+		    n * sizeof (char *));
+		sn->sn_has_ex = xrealloc(sn->sn_has_ex, n * sizeof (boolean_t));
+		for (int c = 0; c < VS_COLUMNS; c++)
+			sn->sn_vs[c] = xrealloc(sn->sn_vs[c],
+			    n * sizeof (uint64_t));
+		sn->sn_leaf = xrealloc(sn->sn_leaf,
+		    n * LEAF_FIELDS * sizeof (uint64_t));
+		sn->sn_leaf_mask = xrealloc(sn->sn_leaf_mask,
+		    n * sizeof (uint64_t));
+		sn->sn_rate = xrealloc(sn->sn_rate,
+		    n * PROGRESS_TYPES * sizeof (double));
+		sn->sn_lat = xrealloc(sn->sn_lat,
+		    n * LAT_TYPES * VDEV_L_HISTO_BUCKETS * sizeof (uint64_t));
+		sn->sn_size = xrealloc(sn->sn_size,
+		    n * SIZE_TYPES * VDEV_RQ_HISTO_BUCKETS * sizeof (uint64_t));
+		sn->sn_queue = xrealloc(sn->sn_queue,
+		    n * QUEUE_TYPES * sizeof (uint64_t));
+		sn->sn_vdevs_alloc = n;
+	}
+	return (sn->sn_nvdevs++);
+}
+
+/*
+ * turn every histogram row in the snapshot into cumulative buckets
+ */
+void
+snapshot_cumulate(snapshot_t *sn) {
+	if (sn->sn_collect & (1 << FG_LATENCY))
+		histo_cumulate(sn->sn_lat, sn->sn_nvdevs * LAT_TYPES,
+		    VDEV_L_HISTO_BUCKETS);
+	if (sn->sn_collect & (1 << FG_SIZE))
+		histo_cumulate(sn->sn_size, sn->sn_nvdevs * SIZE_TYPES,
+		    VDEV_RQ_HISTO_BUCKETS);
+}
+
+/*
+ * when streaming, render the window for the current family and empty it
+ */
+void
+snapshot_flush(snapshot_t *sn) {
+	snapshot_cumulate(sn);
+	print_family(sn, sn->sn_group, sn->sn_family);
+	sn->sn_nvdevs = 0;
+	arena_release(&sn->sn_arena, &sn->sn_mark);
+}
+
+/*
+ * add a histogram from the extended stats into a zeroed, fixed-size row.
+ * Should the kernel have more buckets than we know about, fold the
+ * extras into the last bucket so that the count remains correct.
+ */
+int
+collect_histo(nvlist_t *nv_ex, char *name, uint64_t *row, uint_t buckets) {
+	uint_t c;
+	uint64_t *array;
+
+	if (nvlist_lookup_uint64_array(nv_ex, name, &array, &c) != 0) {
+		fprintf(stderr, "error: can't get %s\n", name);
+		return (3);
+	}
+	for (uint_t j = 0; j < c; j++)
+		row[j < buckets ? j : buckets - 1] += array[j];
+	return (0);
+}
+
+#define	VS_VALUE(vs, offset)	(*(uint64_t *)((char *)(vs) + (offset)))
+
+uint64_t
+vs_field_value(vs_field_desc_t *fd, vdev_stat_t *vs) {
+	uint64_t v = VS_VALUE(vs, fd->offset);
+
+	switch (fd->op) {
+		case VS_OP_FREE:
+			return (v - vs->vs_alloc);
+		default:
+			return (v);
+	}
+}
+
+/*
+ * is the field in the kernel's vdev_stat_t of c uint64s, and does it
+ * apply in the current state?
+ */
+boolean_t
+vs_field_present(vs_field_desc_t *fd, vdev_stat_t *vs, uint_t c) {
+	size_t end = c * sizeof (uint64_t);
+
+	if (fd->offset + sizeof (uint64_t) > end)
+		return (B_FALSE);
+	if (fd->op != VS_OP_IF_STATE)
+		return (B_TRUE);
+	return (fd->state + sizeof (uint64_t) <= end &&
+	    VS_VALUE(vs, fd->state) == fd->state_value);
+}
+
+progress_t *
+progress_lookup(uint64_t guid) {
+	progress_t *old = progress_table, *pg;
+	uint_t n = progress_size;
+
+	/* keep the load under 1/2 */
+	if (2 * (progress_used + 1) > progress_size) {
+		progress_size = n ? n << 1 : 64;
+		progress_table = xrealloc(NULL,
+		    progress_size * sizeof (progress_t));
+		(void) memset(progress_table, 0,
+		    progress_size * sizeof (progress_t));
+		progress_used = 0;
+		for (uint_t i = 0; i < n; i++) {
+			if (old[i].pg_guid == 0)
+				continue;
+			*progress_lookup(old[i].pg_guid) = old[i];
+		}
+		free(old);
+	}
+	for (uint_t i = guid & (progress_size - 1); ;
+	    i = (i + 1) & (progress_size - 1)) {
+		pg = &progress_table[i];
+		if (pg->pg_guid == guid)
+			return (pg);
+		if (pg->pg_guid == 0) {
+			pg->pg_guid = guid;
+			progress_used++;
+			return (pg);
+		}
+	}
+}
+
+/*
+ * add a sample and return the rate over the samples kept, or -1
+ */
+double
+progress_rate(progress_ring_t *pr, double now, uint64_t done) {
+	uint_t last = (pr->pr_next + PROGRESS_SAMPLES - 1) % PROGRESS_SAMPLES;
+	uint_t first;
+
+	/* a new run started */
+	if (pr->pr_count != 0 && done < pr->pr_done[last])
+		pr->pr_count = 0;
+	if (pr->pr_count == 0 || now > pr->pr_time[last]) {
+		pr->pr_time[pr->pr_next] = now;
+		pr->pr_done[pr->pr_next] = done;
+		pr->pr_next = (pr->pr_next + 1) % PROGRESS_SAMPLES;
+		if (pr->pr_count < PROGRESS_SAMPLES)
+			pr->pr_count++;
+	}
+	if (pr->pr_count < 2)
+		return (-1);
+	last = (pr->pr_next + PROGRESS_SAMPLES - 1) % PROGRESS_SAMPLES;
+	first = (pr->pr_next + PROGRESS_SAMPLES - pr->pr_count) %
+	    PROGRESS_SAMPLES;
+	return ((pr->pr_done[last] - pr->pr_done[first]) /
+	    (pr->pr_time[last] - pr->pr_time[first]));
+}
+
+/*
+ * update the progress rates of a leaf vdev
+ */
+void
+collect_progress(snapshot_t *sn, uint_t v, nvlist_t *nvroot,
+                 vdev_stat_t *vs, uint_t c) {
+	progress_desc_t *pd;
+	progress_t *pg = NULL;
+	uint64_t guid;
+
+	for (int t = 0; t < PROGRESS_TYPES; t++)
+		sn->sn_rate[v * PROGRESS_TYPES + t] = -1;
+	if (nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_GUID, &guid) != 0 ||
+	    guid == 0)
+		return;
+	for (int t = 0; t < PROGRESS_TYPES; t++) {
+		pd = &progress_desc[t];
+		if (!FAMILY_ON(FG_PROGRESS, t) ||
+		    pd->done + sizeof (uint64_t) > c * sizeof (uint64_t) ||
+		    pd->state + sizeof (uint64_t) > c * sizeof (uint64_t))
+			continue;
+		if (pg == NULL)
+			pg = progress_lookup(guid);
+		if (VS_VALUE(vs, pd->state) != pd->active) {
+			pg->pg_ring[t].pr_count = 0;
+			continue;
+		}
+		sn->sn_rate[v * PROGRESS_TYPES + t] = progress_rate(
+		    &pg->pg_ring[t], sn->sn_now, VS_VALUE(vs, pd->done));
+	}
+}
+
+/*
+ * copy the stats for a single vdev into the snapshot
+ */
+int
+collect_vdev_stats(snapshot_t *sn, nvlist_t *nvroot, uint_t pool,
+                   const char *parent_name, uint_t depth, vdev_class_t vc,
+                   uint64_t index) {
+	uint_t c, v, children;
+	boolean_t leaf;
+	vdev_stat_t *vs;
+	nvlist_t *nv_ex, **child;
+	uint_t collect = sn->sn_collect & depth_groups(depth);
+
+	if (collect == 0 || nvlist_lookup_uint64_array(nvroot,
+	    ZPOOL_CONFIG_VDEV_STATS, (uint64_t **) &vs, &c) != 0) {
+		return (0);
+	}
+
+	v = snapshot_add_vdev(sn);
+	sn->sn_pool[v] = pool;
+	sn->sn_depth[v] = depth;
+	sn->sn_groups[v] = collect;
+	sn->sn_has_ex[v] = B_FALSE;
+	sn->sn_desc[v] = arena_strdup(&sn->sn_arena,
+	    get_vdev_desc(nvroot, parent_name, vc, index));
+	/*
+	 * Include the state of the vdev as a prometheus label. This allows
+	 * for filtering in queries. However, these do no map directly to all
+	 * of the possible human-readable names in the zpool(8) command output.
+	 * For example, a healthy spare has state "AVAIL" in zpool, but "ONLINE" here.
+	 */
+	sn->sn_state_name[v] = zpool_state_to_name(vs->vs_state, vs->vs_aux);
+
+	for (int f = 0; f < VS_COLUMNS; f++)
+		sn->sn_vs[f][v] = vs_field_value(&vs_column_desc[f], vs);
+
+	leaf = nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) != 0;
+	sn->sn_leaf_mask[v] = 0;
+	if (leaf && (collect & (1 << FG_LEAF))) {
+		for (int f = 0; f < LEAF_FIELDS; f++) {
+			if (!FAMILY_ON(FG_LEAF, f) ||
+			    !vs_field_present(&leaf_field_desc[f], vs, c))
+				continue;
+			sn->sn_leaf[v * LEAF_FIELDS + f] =
+			    vs_field_value(&leaf_field_desc[f], vs);
+			sn->sn_leaf_mask[v] |= 1ULL << f;
+		}
+	}
+	if (leaf && (collect & (1 << FG_PROGRESS)))
+		collect_progress(sn, v, nvroot, vs, c);
+	else if (sn->sn_collect & (1 << FG_PROGRESS))
+		for (int t = 0; t < PROGRESS_TYPES; t++)
+			sn->sn_rate[v * PROGRESS_TYPES + t] = -1;
+
+	/*
+	 * the latency, size, and queue stats need the extended stats.
+	 * The histogram rows are zeroed regardless, so that they can be
+	 * cumulated in one batch with the rest, including the rows of vdevs
+	 * below the depth limit of the group.
+	 */
+	if (sn->sn_collect & (1 << FG_LATENCY))
+		(void) memset(LAT_ROW(sn, v, 0), 0,
+		    LAT_TYPES * VDEV_L_HISTO_BUCKETS * sizeof (uint64_t));
+	if (sn->sn_collect & (1 << FG_SIZE))
+		(void) memset(SIZE_ROW(sn, v, 0), 0,
+		    SIZE_TYPES * VDEV_RQ_HISTO_BUCKETS * sizeof (uint64_t));
+	if (nvlist_lookup_nvlist(nvroot,
+	    ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
+		return (6);
+	}
+	for (int i = 0; i < LAT_TYPES &&
+	    (collect & (1 << FG_LATENCY)); i++) {
+		if (FAMILY_ON(FG_LATENCY, i) &&
+		    collect_histo(nv_ex, lat_type[i].name, LAT_ROW(sn, v, i),
+		    VDEV_L_HISTO_BUCKETS) != 0)
+			return (3);
+	}
+	for (int i = 0; i < SIZE_TYPES &&
+	    (collect & (1 << FG_SIZE)); i++) {
+		if (FAMILY_ON(FG_SIZE, i) &&
+		    collect_histo(nv_ex, size_type[i].name, SIZE_ROW(sn, v, i),
+		    VDEV_RQ_HISTO_BUCKETS) != 0)
+			return (3);
+	}
+	for (int i = 0; i < QUEUE_TYPES &&
+	    (collect & (1 << FG_QUEUE)); i++) {
+		if (FAMILY_ON(FG_QUEUE, i) &&
+		    nvlist_lookup_uint64(nv_ex, queue_type[i].name,
+		    &sn->sn_queue[v * QUEUE_TYPES + i]) != 0) {
+			fprintf(stderr, "error: can't get %s\n",
+			    queue_type[i].name);
+			return (3);
+		}
+	}
+	sn->sn_has_ex[v] = B_TRUE;
+	return (0);
+}
+
+/*
+ * allocation class of a top-level vdev
+ */
+vdev_class_t
+get_vdev_class(nvlist_t *nv) {
+	uint64_t is_log = 0;
+#ifdef ZPOOL_CONFIG_ALLOCATION_BIAS
+	char *bias;
+
+	if (nvlist_lookup_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS,
+	    &bias) == 0) {
+		if (strcmp(bias, VDEV_ALLOC_BIAS_SPECIAL) == 0)
+			return (VC_SPECIAL);
+		if (strcmp(bias, VDEV_ALLOC_BIAS_DEDUP) == 0)
+			return (VC_DEDUP);
+		if (strcmp(bias, VDEV_ALLOC_BIAS_LOG) == 0)
+			return (VC_LOG);
+	}
+#endif
+	(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_LOG, &is_log);
+	return (is_log ? VC_LOG : VC_NORMAL);
+}
+
+/*
+ * series printed for a vdev by the families of a group that are on,
+ * before any are omitted for lack of stats
+ */
+uint64_t
+group_series(family_group_t g, uint_t depth, boolean_t leaf) {
+	uint64_t per_family, on = 0;
+
+	switch (g) {
+		case FG_SUMMARY:
+			per_family = 1;
+			break;
+		case FG_LEAF:
+		case FG_PROGRESS:
+			per_family = leaf ? 1 : 0;
+			break;
+		case FG_LATENCY:
+			per_family =
+			    VDEV_L_HISTO_BUCKETS - 1 - MIN_LAT_INDEX + 3;
+			break;
+		case FG_SIZE:
+			per_family = VDEV_RQ_HISTO_BUCKETS - MIN_SIZE_INDEX + 3;
+			break;
+		case FG_QUEUE:
+			per_family = depth == 0 ? 1 : 0;
+			break;
+		default:
+			return (0);
+	}
+	for (int i = 0; i < family_count[g]; i++) {
+		if (FAMILY_ON(g, i))
+			on++;
+	}
+	return (per_family * on);
+}
+
+void
+count_vdevs(nvlist_t *nv, uint_t depth,
+            uint64_t counts[DEPTH_COUNT_MAX + 1][2]) {
+	uint_t c, children;
+	nvlist_t **child;
+	boolean_t leaf = nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) != 0;
+
+	counts[depth < DEPTH_COUNT_MAX ? depth : DEPTH_COUNT_MAX][leaf]++;
+	for (c = 0; !leaf && c < children; c++)
+		count_vdevs(child[c], depth + 1, counts);
+	if (depth == 0) {
+		if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_L2CACHE,
+		    &child, &children) == 0)
+			counts[1][1] += children;
+		if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_SPARES,
+		    &child, &children) == 0)
+			counts[1][1] += children;
+	}
+}
+
+/*
+ * With a series cap, the pools are given what is left of it in turn,
+ * in the order of zpool_iter(), which is sorted by name. A pool gets the
+ * deepest levels of its tree that fit, so that with too many vdevs the
+ * leaves go first and the pool-wide view is kept. This only counts the
+ * vdevs, with no stats lookup. Returns the deepest level, or -1 if not
+ * even the root fits.
+ */
+int
+pool_depth_limit(nvlist_t *nvroot) {
+	uint64_t counts[DEPTH_COUNT_MAX + 1][2];
+	uint64_t cost, total = 0;
+	uint_t groups;
+	int d;
+
+	if (series_cap == 0)
+		return (INT_MAX);
+	(void) memset(counts, 0, sizeof (counts));
+	count_vdevs(nvroot, 0, counts);
+	for (d = 0; d <= DEPTH_COUNT_MAX; d++) {
+		groups = depth_groups(d) & snap.sn_collect & FG_VDEV;
+		cost = 0;
+		for (int g = 0; g < FG_GROUPS; g++) {
+			if (!(groups & (1 << g)))
+				continue;
+			cost += counts[d][0] * group_series(g, d, B_FALSE) +
+			    counts[d][1] * group_series(g, d, B_TRUE);
+		}
+		if (total + cost > series_left)
+			break;
+		total += cost;
+	}
+	series_left -= total;
+	return (d > DEPTH_COUNT_MAX ? INT_MAX : d - 1);
+}
+
+/*
+ * cache and spare devices, which are leaves, named <root>/<class>/<type>-<i>
+ */
+void
+collect_aux_stats(snapshot_t *sn, nvlist_t *nvroot, uint_t pool,
+                  const char *root_name, char *array, vdev_class_t vc) {
+	uint_t c, children;
+	nvlist_t **child;
+	char parent_name[256];
+
+	if (nvlist_lookup_nvlist_array(nvroot, array, &child,
+	    &children) != 0)
+		return;
+	(void) snprintf(parent_name, sizeof (parent_name), "%s/%s",
+	    root_name, vdev_class_name[vc]);
+	for (c = 0; c < children; c++) {
+		if (sn->sn_vdev_limit != 0 &&
+		    sn->sn_nvdevs == sn->sn_vdev_limit)
+			snapshot_flush(sn);
+		(void) collect_vdev_stats(sn, child[c], pool, parent_name, 1,
+		    vc, c);
+	}
+}
+
+/*
+ * recursive stats collector
+ */
+int
+collect_recursive_stats(snapshot_t *sn, nvlist_t *nvroot, uint_t pool,
+                        const char *parent_name, uint_t depth,
+                        vdev_class_t vc) {
+	uint_t c, children;
+	nvlist_t **child;
+	char vdev_name[256];
+
+	if ((int)depth > sn->sn_pool_depth[pool])
+		return (0);
+	if (sn->sn_vdev_limit != 0 && sn->sn_nvdevs == sn->sn_vdev_limit)
+		snapshot_flush(sn);
+
+	/* a vdev without extended stats still has children worth a look */
+	(void) collect_vdev_stats(sn, nvroot, pool, parent_name, depth, vc,
+	    -1ULL);
+
+	/* nothing wanted below this depth */
+	if ((int)depth >= sn->sn_pool_depth[pool] ||
+	    (sn->sn_collect & FG_VDEV & depth_groups(depth + 1)) == 0)
+		return (0);
+
+	if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) == 0) {
+		(void) strncpy(vdev_name, get_vdev_name(nvroot, parent_name),
+		    sizeof(vdev_name));
+		vdev_name[sizeof(vdev_name) - 1] = '\0';
+
+		for (c = 0; c < children; c++) {
+			collect_recursive_stats(sn, child[c], pool,
+			    vdev_name, depth + 1,
+			    depth == 0 ? get_vdev_class(child[c]) : vc);
+		}
+	}
+	if (depth == 0) {
+		(void) strncpy(vdev_name, get_vdev_name(nvroot, parent_name),
+		    sizeof(vdev_name));
+		vdev_name[sizeof(vdev_name) - 1] = '\0';
+		collect_aux_stats(sn, nvroot, pool, vdev_name,
+		    ZPOOL_CONFIG_L2CACHE, VC_CACHE);
+		collect_aux_stats(sn, nvroot, pool, vdev_name,
+		    ZPOOL_CONFIG_SPARES, VC_SPARE);
+	}
+	return (0);
+}
+
+/*
+ * vdev latency stats are histograms stored as nvlist arrays of uint64.
+ * Latency stats include the ZIO scheduler classes plus lower-level
+ * vdev latencies.
+ *
+ * In many cases, the top-level "root" view obscures the underlying
+ * top-level vdev operations. For example, if a pool has a log, special,
+ * or cache device, then each can behave very differently. It is useful
+ * to see how each is responding.
+ */
+void
+print_vdev_latency_stats(snapshot_t *sn, int i) {
+	uint_t end = VDEV_L_HISTO_BUCKETS - 1;
+	uint64_t *row;
+	char *pool_name, *vdev_desc;
+	histo_names_t *hn = &lat_names[i];
+
+	for (uint_t v = 0; v < sn->sn_nvdevs; v++) {
+		if (!sn->sn_has_ex[v] || !(sn->sn_groups[v] & (1 << FG_LATENCY)))
+			continue;
+		row = LAT_ROW(sn, v, i);
+		pool_name = sn->sn_pool_name[sn->sn_pool[v]];
+		vdev_desc = sn->sn_desc[v];
+		for (uint_t j = MIN_LAT_INDEX; j < end; j++)
+			print_histo_sample(hn->bucket, pool_name,
+			    vdev_desc, lat_le[j], row[j]);
+		print_histo_sample(hn->bucket, pool_name, vdev_desc,
+		    inf_le, row[end]);
+		/* TODO: zpool code update to include sum */
+		print_histo_sample(hn->sum, pool_name, vdev_desc,
+		    no_le, 0);
+		print_histo_sample(hn->count, pool_name, vdev_desc,
+		    no_le, row[end]);
+	}
+}
+
+/*
+ * vdev request size stats are histograms stored as nvlist arrays of uint64.
+ * Request size stats include the ZIO scheduler classes plus lower-level
+ * vdev sizes. Both independent (ind) and aggregated (agg) sizes are reported.
+ *
+ * In many cases, the top-level "root" view obscures the underlying
+ * top-level vdev operations. For example, if a pool has a log, special,
+ * or cache device, then each can behave very differently. It is useful
+ * to see how each is responding.
+ */
+void
+print_vdev_size_stats(snapshot_t *sn, int i) {
+	uint_t end = VDEV_RQ_HISTO_BUCKETS - 1;
+	uint64_t *row;
+	char *pool_name, *vdev_desc;
+	histo_names_t *hn = &size_names[i];
+
+	for (uint_t v = 0; v < sn->sn_nvdevs; v++) {
+		if (!sn->sn_has_ex[v] || !(sn->sn_groups[v] & (1 << FG_SIZE)))
+			continue;
+		row = SIZE_ROW(sn, v, i);
+		pool_name = sn->sn_pool_name[sn->sn_pool[v]];
+		vdev_desc = sn->sn_desc[v];
+		for (uint_t j = MIN_SIZE_INDEX; j <= end; j++)
+			print_histo_sample(hn->bucket, pool_name,
+			    vdev_desc, size_le[j], row[j]);
+		print_histo_sample(hn->bucket, pool_name, vdev_desc,
+		    inf_le, row[end]);
+		/*
+		 * TODO: zpool code update to include sum?
+		 * Though sum is useless here and arguably redundant
+		 * with other I/O size measurements. Does it makes
+		 * sense to sum?
+		 */
+		print_histo_sample(hn->sum, pool_name, vdev_desc,
+		    no_le, 0);
+		print_histo_sample(hn->count, pool_name, vdev_desc,
+		    no_le, row[end]);
+	}
+}
+
+/*
+ * ZIO scheduler queue stats are stored as gauges. This is unfortunate
+ * because the values can change very rapidly and any point-in-time
+ * value will quickly be obsoleted. It is also not easy to downsample.
+ * Thus only the top-level queue stats might be beneficial... maybe.
+ */
+void
+print_queue_stats(snapshot_t *sn, int i) {
+	char *metric_name = families[FAMILY_ID(FG_QUEUE, i)].fd_name;
+
+	for (uint_t v = 0; v < sn->sn_nvdevs; v++) {
+		if (sn->sn_depth[v] != 0 || !sn->sn_has_ex[v] ||
+		    !(sn->sn_groups[v] & (1 << FG_QUEUE)))
+			continue;
+		(void) printf("%s{name=\"%s\",%s} %"PRIu64"\n",
+		    metric_name, sn->sn_pool_name[sn->sn_pool[v]],
+		    sn->sn_desc[v],
+		    sn->sn_queue[v * QUEUE_TYPES + i] & SIGNIFICAND_MASK);
+	}
+}
+
+/*
+ * Summary stats for each vdev are familiar to the "zpool status"
+ * and "zpool list" users.
+ */
+void
+print_summary_stats(snapshot_t *sn, int c) {
+	uint64_t *col = sn->sn_vs[c];
+	char *metric_name = families[FAMILY_ID(FG_SUMMARY, c)].fd_name;
+
+	boolean_t percent = (vs_column_desc[c].op == VS_OP_PERCENT);
+
+	for (uint_t v = 0; v < sn->sn_nvdevs; v++) {
+		if (!(sn->sn_groups[v] & (1 << FG_SUMMARY)))
+			continue;
+		/* such as ZFS_FRAG_INVALID, for vdevs without metaslabs */
+		if (percent && col[v] > 100)
+			continue;
+		(void) printf("%s{name=\"%s\",state=\"%s\",%s} ", metric_name,
+		    sn->sn_pool_name[sn->sn_pool[v]],
+		    sn->sn_state_name[v], sn->sn_desc[v]);
+		if (percent)
+			(void) printf("%"PRIu64".%02"PRIu64"\n", col[v] / 100,
+			    col[v] % 100);
+		else
+			print_value_u64(col[v]);
+	}
+}
+
+/*
+ * leaf vdev stats, for the fields the kernel has
+ */
+void
+print_leaf_stats(snapshot_t *sn, int f) {
+	char *metric_name = families[FAMILY_ID(FG_LEAF, f)].fd_name;
+
+	for (uint_t v = 0; v < sn->sn_nvdevs; v++) {
+		if (!(sn->sn_leaf_mask[v] & (1ULL << f)))
+			continue;
+		(void) printf("%s{name=\"%s\",state=\"%s\",%s} ", metric_name,
+		    sn->sn_pool_name[sn->sn_pool[v]],
+		    sn->sn_state_name[v], sn->sn_desc[v]);
+		print_value_u64(sn->sn_leaf[v * LEAF_FIELDS + f]);
+	}
+}
+
+/*
+ * progress rates of running initialize and TRIM, per leaf vdev
+ */
+void
+print_progress_stats(snapshot_t *sn, int t) {
+	char *metric_name = families[FAMILY_ID(FG_PROGRESS, t)].fd_name;
+	double rate;
+
+	for (uint_t v = 0; v < sn->sn_nvdevs; v++) {
+		rate = sn->sn_rate[v * PROGRESS_TYPES + t];
+		if (rate < 0)
+			continue;
+		(void) printf("%s{name=\"%s\",state=\"%s\",%s} %f\n",
+		    metric_name, sn->sn_pool_name[sn->sn_pool[v]],
+		    sn->sn_state_name[v], sn->sn_desc[v], rate);
+	}
+}
+
+/*
+ * scan stats, per pool
+ */
+void
+print_scan_status(snapshot_t *sn, int m) {
+	double value;
+
+	for (uint_t i = 0; i < sn->sn_npools; i++) {
+		if (!sn->sn_has_scan[i])
+			continue;
+		value = sn->sn_scan_val[i * SCAN_METRICS + m];
+		if (isnan(value))
+			continue;
+		(void) printf("%s{name=\"%s\",state=\"%s\"} ",
+		    families[FAMILY_ID(FG_SCAN, m)].fd_name,
+		    sn->sn_pool_name[i], sn->sn_scan_state[i]);
+		if (scan_metric_desc[m].is_double)
+			(void) printf("%f\n", value);
+		else
+			(void) printf("%"PRIu64"\n", (uint64_t) value);
+	}
+}
+
+/*
+ * dedup table stats, per pool
+ */
+void
+print_ddt_stats(snapshot_t *sn, int m) {
+	char *metric = families[FAMILY_ID(FG_DDT, m)].fd_name;
+	uint64_t *val;
+
+	for (uint_t i = 0; i < sn->sn_npools; i++) {
+		if (!sn->sn_has_ddt[i])
+			continue;
+		val = &sn->sn_ddt[i * DDT_VALUES];
+		if (m != DDT_REFCOUNT) {
+			(void) printf("%s{name=\"%s\"} ", metric,
+			    sn->sn_pool_name[i]);
+			print_value_u64(val[m]);
+			continue;
+		}
+		for (int j = 0; j < DDT_HISTO_BUCKETS; j++) {
+			(void) printf("%s{name=\"%s\"%s", ddt_names.bucket,
+			    sn->sn_pool_name[i], ddt_le[j]);
+			print_value_u64(val[DDT_REFCOUNT + j]);
+		}
+		(void) printf("%s{name=\"%s\"%s", ddt_names.bucket,
+		    sn->sn_pool_name[i], inf_le);
+		print_value_u64(val[DDT_BLOCKS]);
+		(void) printf("%s{name=\"%s\"} ", ddt_names.sum,
+		    sn->sn_pool_name[i]);
+		print_value_u64(val[DDT_REF_BLOCKS]);
+		(void) printf("%s{name=\"%s\"} ", ddt_names.count,
+		    sn->sn_pool_name[i]);
+		print_value_u64(val[DDT_BLOCKS]);
+	}
+}
+
+/*
+ * per class stats, space then latency histograms
+ */
+void
+print_class_stats(snapshot_t *sn, int m) {
+	char *metric = families[FAMILY_ID(FG_CLASS, m)].fd_name;
+	histo_names_t *hn = &class_lat_names[m - CLASS_SPACE];
+	uint_t end = VDEV_L_HISTO_BUCKETS - 1;
+	uint64_t *row;
+	char *pool_name;
+
+	for (uint_t p = 0; p < sn->sn_npools; p++) {
+		pool_name = sn->sn_pool_name[p];
+		for (int k = VC_NORMAL; k < VDEV_CLASSES; k++) {
+			if (!(sn->sn_class_mask[p] & (1 << k)))
+				continue;
+			if (m < CLASS_SPACE) {
+				(void) printf("%s{name=\"%s\",%s} ", metric,
+				    pool_name, class_desc[k]);
+				print_value_u64(sn->sn_class_space[(p *
+				    VDEV_CLASSES + k) * CLASS_SPACE + m]);
+				continue;
+			}
+			row = CLASS_LAT_ROW(sn, p, k, m - CLASS_SPACE);
+			for (uint_t j = MIN_LAT_INDEX; j < end; j++)
+				print_histo_sample(hn->bucket, pool_name,
+				    class_desc[k], lat_le[j], row[j]);
+			print_histo_sample(hn->bucket, pool_name,
+			    class_desc[k], inf_le, row[end]);
+			print_histo_sample(hn->sum, pool_name, class_desc[k],
+			    no_le, 0);
+			print_histo_sample(hn->count, pool_name, class_desc[k],
+			    no_le, row[end]);
+		}
+	}
+}
+
+/*
+ * HELP and TYPE for a metric family, printed once before its samples
+ */
+void
+print_family_header(family_group_t g, int i) {
+	family_desc_t *fd = &families[FAMILY_ID(g, i)];
+
+	print_help_type(fd->fd_name, fd->fd_help, fd->fd_type);
+}
+
+void
+print_kfamily_header(kstat_group_t k, int i) {
+	family_desc_t *fd = &families[KFAMILY_ID(k, i)];
+
+	print_help_type(fd->fd_name, fd->fd_help, fd->fd_type);
+}
+
+/*
+ * print the samples of one metric family for all vdevs in the snapshot
+ */
+void
+print_family(snapshot_t *sn, family_group_t g, int i) {
+	switch (g) {
+		case FG_SUMMARY:
+			print_summary_stats(sn, i);
+			break;
+		case FG_LEAF:
+			print_leaf_stats(sn, i);
+			break;
+		case FG_PROGRESS:
+			print_progress_stats(sn, i);
+			break;
+		case FG_LATENCY:
+			print_vdev_latency_stats(sn, i);
+			break;
+		case FG_SIZE:
+			print_vdev_size_stats(sn, i);
+			break;
+		case FG_QUEUE:
+			print_queue_stats(sn, i);
+			break;
+		case FG_SCAN:
+			print_scan_status(sn, i);
+			break;
+		case FG_DDT:
+			print_ddt_stats(sn, i);
+			break;
+		case FG_CLASS:
+			print_class_stats(sn, i);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * self-monitoring: how much memory did it take to produce this output?
+ */
+void
+print_self_stats(snapshot_t *sn) {
+	struct rusage ru;
+
+	print_prom_u64(COMMAND_NAME, "snapshot_bytes", NULL,
+	    snapshot_bytes(sn), "memory allocated for the stats snapshot",
+	    "gauge");
+	print_prom_u64(COMMAND_NAME, "heap_allocs_total", NULL, heap_allocs,
+	    "heap allocations made by the collector", "counter");
+	print_prom_u64(COMMAND_NAME, "arena_allocs_total", NULL,
+	    sn->sn_arena.a_allocs, "strings allocated from the arena",
+	    "counter");
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		print_prom_u64(COMMAND_NAME, "max_rss_bytes", NULL,
+		    (uint64_t) ru.ru_maxrss * 1024,
+		    "peak resident set size of the collector", "gauge");
+	if (config_time != 0)
+		print_prom_u64(COMMAND_NAME, "config_age_seconds", NULL,
+		    time(NULL) - config_time,
+		    "time since the pool configs were refreshed", "gauge");
+}
+
+/*
+ * render the whole snapshot, already cumulated
+ */
+void
+print_snapshot(snapshot_t *sn) {
+	for (int g = 0; g < FG_GROUPS; g++) {
+		for (int i = 0; i < family_count[g]; i++) {
+			if (!FAMILY_ON(g, i))
+				continue;
+			print_family_header(g, i);
+			print_family(sn, g, i);
+		}
+	}
+}
+
+/*
+ * Streaming keeps the memory used bounded, regardless of the number of
+ * vdevs. For each metric family, the vdev tree of each pool is walked
+ * again, collecting only that family's group into a window of at most
+ * sn_vdev_limit vdevs. Whenever the window fills, it is rendered and
+ * reused. The pool configs are held by libzfs in any case, so walking
+ * them again costs nvlist lookups, but no memory.
+ */
+void
+print_stream(snapshot_t *sn) {
+	arena_mark(&sn->sn_arena, &sn->sn_mark);
+	for (int g = 0; g < FG_GROUPS; g++) {
+		if (!(family_on->fs_groups & (1 << g)))
+			continue;
+		sn->sn_collect = 1 << g;
+		sn->sn_group = g;
+		for (int i = 0; i < family_count[g]; i++) {
+			if (!FAMILY_ON(g, i))
+				continue;
+			print_family_header(g, i);
+			if (g == FG_SCAN || g == FG_DDT || g == FG_CLASS) {
+				/* per pool, already collected */
+				print_family(sn, g, i);
+				continue;
+			}
+			sn->sn_family = i;
+			for (uint_t p = 0; p < sn->sn_npools; p++)
+				(void) collect_recursive_stats(sn,
+				    sn->sn_nvroot[p], p, NULL, 0, VC_NONE);
+			snapshot_flush(sn);
+		}
+	}
+}
+
+/*
+ * Pool properties change slowly, and getting them is an ioctl per pool
+ * on a fresh handle, so they are cached per pool and only read again
+ * after prop_refresh_secs. Percents are printed as ratios, as for the
+ * vdev stats, and dedupratio, kept by ZFS as a percent, too.
+ */
+#define	PROP_REFRESH_SECS	60
+
+typedef struct pool_prop_desc {
+	zpool_prop_t	prop;
+	char		*name;
+	char		*help;
+	boolean_t	percent;
+} pool_prop_desc_t;
+
+pool_prop_desc_t pool_prop_desc[] = {
+	{ZPOOL_PROP_SIZE,	"size_bytes",	"pool size"},
+	{ZPOOL_PROP_ALLOCATED,	"allocated_bytes", "space allocated"},
+	{ZPOOL_PROP_FREE,	"free_bytes",	"space free"},
+	{ZPOOL_PROP_FREEING,	"freeing_bytes",
+	    "space being freed in the background"},
+	{ZPOOL_PROP_LEAKED,	"leaked_bytes",
+	    "space leaked by background frees"},
+	{ZPOOL_PROP_EXPANDSZ,	"expandsize_bytes",
+	    "space available to expand the pool"},
+	{ZPOOL_PROP_CHECKPOINT,	"checkpoint_bytes",
+	    "space used by the checkpoint"},
+	{ZPOOL_PROP_CAPACITY,	"capacity_ratio", "space allocated ratio",
+	    B_TRUE},
+	{ZPOOL_PROP_FRAGMENTATION, "fragmentation_ratio",
+	    "free space fragmentation metric", B_TRUE},
+	{ZPOOL_PROP_DEDUPRATIO,	"dedup_ratio",	"deduplication ratio",
+	    B_TRUE},
+};
+#define	POOL_PROPS	(sizeof (pool_prop_desc) / sizeof (pool_prop_desc[0]))
+
+/* features are 0 disabled, 1 enabled, 2 active, or unknown to the pool */
+char *pool_features[] = {
+	"async_destroy", "empty_bpobj", "lz4_compress",
+	"multi_vdev_crash_dump", "spacemap_histogram", "enabled_txg",
+	"hole_birth", "extensible_dataset", "embedded_data", "bookmarks",
+	"filesystem_limits", "large_blocks", "large_dnode", "sha512", "skein",
+	"edonr", "userobj_accounting", "encryption", "project_quota",
+	"device_removal", "obsolete_counts", "zpool_checkpoint",
+	"spacemap_v2", "allocation_classes", "resilver_defer", "bookmark_v2",
+	"redaction_bookmarks", "redacted_datasets", "bookmark_written",
+	"log_spacemap", "livelist", "device_rebuild", "zstd_compress", "draid",
+};
+#define	POOL_FEATURES	(sizeof (pool_features) / sizeof (pool_features[0]))
+#define	FEATURE_UNKNOWN	(-1)
+
+typedef struct pool_props {
+	char		*pp_name;
+	char		*pp_label;		/* escaped pool name */
+	boolean_t	pp_seen;		/* in the last config refresh */
+	time_t		pp_time;		/* when read, 0 = never */
+	uint64_t	pp_val[POOL_PROPS];
+	int		pp_feature[POOL_FEATURES];
+} pool_props_t;
+
+pool_props_t *pool_props = NULL;
+uint_t pool_nprops = 0;
+time_t prop_refresh_secs = PROP_REFRESH_SECS;
+
+pool_props_t *
+pool_props_lookup(char *pool_name) {
+	pool_props_t *pp;
+
+	for (uint_t i = 0; i < pool_nprops; i++) {
+		if (strcmp(pool_props[i].pp_name, pool_name) == 0)
+			return (&pool_props[i]);
+	}
+	pool_props = xrealloc(pool_props,
+	    (pool_nprops + 1) * sizeof (pool_props_t));
+	pp = &pool_props[pool_nprops++];
+	(void) memset(pp, 0, sizeof (*pp));
+	pp->pp_name = xasprintf("%s", pool_name);
+	pp->pp_label = escape_label(pool_name);
+	return (pp);
+}
+
+void
+collect_pool_props(zpool_handle_t *zhp) {
+	pool_props_t *pp = pool_props_lookup(zhp->zpool_name);
+	char feature[64], state[16];
+	time_t now = time(NULL);
+
+	pp->pp_seen = B_TRUE;
+	if (pp->pp_time != 0 && now - pp->pp_time < prop_refresh_secs)
+		return;
+	pp->pp_time = now;
+	for (uint_t i = 0; i < POOL_PROPS; i++)
+		pp->pp_val[i] = zpool_get_prop_int(zhp, pool_prop_desc[i].prop,
+		    NULL);
+	for (uint_t i = 0; i < POOL_FEATURES; i++) {
+		(void) snprintf(feature, sizeof (feature), "feature@%s",
+		    pool_features[i]);
+		if (zpool_prop_get_feature(zhp, feature, state,
+		    sizeof (state)) != 0)
+			pp->pp_feature[i] = FEATURE_UNKNOWN;
+		else if (strcmp(state, "active") == 0)
+			pp->pp_feature[i] = 2;
+		else
+			pp->pp_feature[i] = (strcmp(state, "enabled") == 0);
+	}
+}
+
+/*
+ * drop the pools not seen in the last config refresh
+ */
+void
+pool_props_prune(void) {
+	uint_t i, n = 0;
+
+	for (i = 0; i < pool_nprops; i++) {
+		if (!pool_props[i].pp_seen) {
+			free(pool_props[i].pp_name);
+			free(pool_props[i].pp_label);
+			continue;
+		}
+		pool_props[n++] = pool_props[i];
+	}
+	pool_nprops = n;
+}
+
+void
+print_pool_props(void) {
+	pool_props_t *pp;
+	char *metric;
+	uint64_t v;
+	uint_t i, j;
+
+	if (pool_nprops == 0 || !KGROUP_ON(KG_PROPS))
+		return;
+	for (j = 0; j < POOL_PROPS; j++) {
+		if (!KFAMILY_ON(KG_PROPS, j))
+			continue;
+		metric = families[KFAMILY_ID(KG_PROPS, j)].fd_name;
+		print_kfamily_header(KG_PROPS, j);
+		for (i = 0, pp = pool_props; i < pool_nprops; i++, pp++) {
+			v = pp->pp_val[j];
+			if (!pp->pp_seen || (pool_prop_desc[j].percent &&
+			    v == UINT64_MAX))
+				continue;
+			(void) printf("%s{name=\"%s\"} ", metric, pp->pp_label);
+			if (pool_prop_desc[j].percent)
+				(void) printf("%"PRIu64".%02"PRIu64"\n", v / 100,
+				    v % 100);
+			else
+				print_value_u64(v);
+		}
+	}
+	if (!KFAMILY_ON(KG_PROPS, POOL_PROPS))
+		return;
+	print_kfamily_header(KG_PROPS, POOL_PROPS);
+	for (i = 0, pp = pool_props; i < pool_nprops; i++, pp++) {
+		if (!pp->pp_seen)
+			continue;
+		for (j = 0; j < POOL_FEATURES; j++) {
+			if (pp->pp_feature[j] != FEATURE_UNKNOWN)
+				(void) printf(PROPS_MEASUREMENT "_feature{"
+				    "name=\"%s\",feature=\"%s\"} %d\n",
+				    pp->pp_label, pool_features[j],
+				    pp->pp_feature[j]);
+		}
+	}
+}
+
+/*
+ * add a top-level vdev into the stats of its class
+ */
+void
+class_add(snapshot_t *sn, uint_t pool, vdev_class_t vc, nvlist_t *nv) {
+	uint64_t *space = &sn->sn_class_space[(pool * VDEV_CLASSES + vc) *
+	    CLASS_SPACE];
+	vdev_stat_t *vs;
+	nvlist_t *nv_ex;
+	uint_t c;
+
+	if (nvlist_lookup_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
+	    (uint64_t **) &vs, &c) != 0)
+		return;
+	sn->sn_class_mask[pool] |= 1 << vc;
+	for (int i = 0; i < CLASS_SPACE; i++)
+		space[i] += vs_field_value(
+		    &vs_column_desc[class_space_column[i]], vs);
+	if (nvlist_lookup_nvlist(nv, ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0)
+		return;
+	for (int t = 0; t < LAT_TYPES; t++) {
+		if (FAMILY_ON(FG_CLASS, CLASS_SPACE + t))
+			(void) collect_histo(nv_ex, lat_type[t].name,
+			    CLASS_LAT_ROW(sn, pool, vc, t),
+			    VDEV_L_HISTO_BUCKETS);
+	}
+}
+
+/*
+ * The class stats are summed here, as there are few top-level vdevs,
+ * rather than by the printers, so that streaming has them too.
+ */
+void
+collect_class_stats(snapshot_t *sn, uint_t pool, nvlist_t *nvroot) {
+	uint_t c, children;
+	nvlist_t **child;
+
+	(void) memset(&sn->sn_class_space[pool * VDEV_CLASSES * CLASS_SPACE],
+	    0, VDEV_CLASSES * CLASS_SPACE * sizeof (uint64_t));
+	(void) memset(CLASS_LAT_ROW(sn, pool, 0, 0), 0, VDEV_CLASSES *
+	    LAT_TYPES * VDEV_L_HISTO_BUCKETS * sizeof (uint64_t));
+	if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) == 0) {
+		for (c = 0; c < children; c++)
+			class_add(sn, pool, get_vdev_class(child[c]), child[c]);
+	}
+	if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_L2CACHE,
+	    &child, &children) == 0) {
+		for (c = 0; c < children; c++)
+			class_add(sn, pool, VC_CACHE, child[c]);
+	}
+	if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_SPARES,
+	    &child, &children) == 0) {
+		for (c = 0; c < children; c++)
+			class_add(sn, pool, VC_SPARE, child[c]);
+	}
+	histo_cumulate(CLASS_LAT_ROW(sn, pool, 0, 0),
+	    VDEV_CLASSES * LAT_TYPES, VDEV_L_HISTO_BUCKETS);
+}
+
+/*
+ * The DDT stats are summed over all the DDTs of the pool by the kernel.
+ * Older kernels can have shorter arrays, the rest is left 0.
+ */
+void
+collect_ddt_stats(snapshot_t *sn, uint_t pool, nvlist_t *config) {
+	uint64_t *val = &sn->sn_ddt[pool * DDT_VALUES];
+	uint64_t *p;
+	ddt_object_t ddo;
+	ddt_stat_t dds;
+	ddt_histogram_t *ddh;
+	boolean_t have_stats;
+	uint_t c, j;
+
+	if (nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_OBJ_STATS,
+	    &p, &c) != 0)
+		return;
+	(void) memset(&ddo, 0, sizeof (ddo));
+	c *= sizeof (uint64_t);
+	(void) memcpy(&ddo, p, c < sizeof (ddo) ? c : sizeof (ddo));
+	(void) memset(val, 0, DDT_VALUES * sizeof (uint64_t));
+	val[DDT_ENTRIES] = ddo.ddo_count;
+	val[DDT_DISK_BYTES] = ddo.ddo_dspace;
+	val[DDT_CORE_BYTES] = ddo.ddo_mspace;
+	sn->sn_has_ddt[pool] = B_TRUE;
+
+	have_stats = nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_STATS,
+	    &p, &c) == 0;
+	if (have_stats) {
+		(void) memset(&dds, 0, sizeof (dds));
+		c *= sizeof (uint64_t);
+		(void) memcpy(&dds, p, c < sizeof (dds) ? c : sizeof (dds));
+		val[DDT_BLOCKS] = dds.dds_blocks;
+		val[DDT_LSIZE] = dds.dds_lsize;
+		val[DDT_PSIZE] = dds.dds_psize;
+		val[DDT_DSIZE] = dds.dds_dsize;
+		val[DDT_REF_BLOCKS] = dds.dds_ref_blocks;
+		val[DDT_REF_LSIZE] = dds.dds_ref_lsize;
+		val[DDT_REF_PSIZE] = dds.dds_ref_psize;
+		val[DDT_REF_DSIZE] = dds.dds_ref_dsize;
+	}
+
+	/* the buckets are cumulated here, they are few and per pool */
+	if (nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_HISTOGRAM,
+	    &p, &c) == 0) {
+		ddh = (ddt_histogram_t *)p;
+		c = c * sizeof (uint64_t) / sizeof (ddt_stat_t);
+		for (j = 0; j < DDT_HISTO_BUCKETS; j++)
+			val[DDT_REFCOUNT + j] = (j > 0 ?
+			    val[DDT_REFCOUNT + j - 1] : 0) +
+			    (j < c ? ddh->ddh_stat[j].dds_blocks : 0);
+		/* the totals, and so +Inf, are the sums of all buckets */
+		for (j = 0; !have_stats && j < c; j++) {
+			val[DDT_BLOCKS] += ddh->ddh_stat[j].dds_blocks;
+			val[DDT_LSIZE] += ddh->ddh_stat[j].dds_lsize;
+			val[DDT_PSIZE] += ddh->ddh_stat[j].dds_psize;
+			val[DDT_DSIZE] += ddh->ddh_stat[j].dds_dsize;
+			val[DDT_REF_BLOCKS] += ddh->ddh_stat[j].dds_ref_blocks;
+			val[DDT_REF_LSIZE] += ddh->ddh_stat[j].dds_ref_lsize;
+			val[DDT_REF_PSIZE] += ddh->ddh_stat[j].dds_ref_psize;
+			val[DDT_REF_DSIZE] += ddh->ddh_stat[j].dds_ref_dsize;
+		}
+	}
+}
+
+/*
+ * call-back to collect the stats from the pool config into the snapshot
+ *
+ * Note: if the pool is broken, this can hang indefinitely
+ */
+int
+collect_stats(zpool_handle_t *zhp, void *data) {
+	int err;
+	uint_t c, pool;
+	boolean_t missing;
+	nvlist_t *config, *nvroot;
+	vdev_stat_t *vs;
+	uint64_t *ps;
+	pool_scan_stat_t scan;
+
+	/* if not this pool return quickly */
+	if (data &&
+	    strncmp(data, zhp->zpool_name, ZFS_MAX_DATASET_NAME_LEN) != 0) {
+		zpool_close(zhp);
+		return (0);
+	}
+
+	if (zpool_refresh_stats(zhp, &missing) != 0) {
+		zpool_close(zhp);
+		return (1);
+	}
+
+	config = zpool_get_config(zhp, NULL);
+
+	if (nvlist_lookup_nvlist(
+	    config, ZPOOL_CONFIG_VDEV_TREE, &nvroot) != 0) {
+		zpool_close(zhp);
+		return (2);
+	}
+	if (nvlist_lookup_uint64_array(nvroot,
+	    ZPOOL_CONFIG_VDEV_STATS,
+	    (uint64_t **) &vs, &c) != 0) {
+		zpool_close(zhp);
+		return (3);
+	}
+
+	pool = snapshot_add_pool(&snap, zhp->zpool_name);
+
+	/* older kernels can have a shorter pool_scan_stat_t */
+	if ((snap.sn_collect & (1 << FG_SCAN)) &&
+	    nvlist_lookup_uint64_array(nvroot, ZPOOL_CONFIG_SCAN_STATS,
+	    &ps, &c) == 0) {
+		(void) memset(&scan, 0, sizeof (scan));
+		c *= sizeof (uint64_t);
+		(void) memcpy(&scan, ps, c < sizeof (scan) ? c : sizeof (scan));
+		(void) collect_scan_status(&snap, pool, &scan);
+	}
+	if (snap.sn_collect & (1 << FG_DDT))
+		collect_ddt_stats(&snap, pool, config);
+	if (snap.sn_collect & (1 << FG_CLASS))
+		collect_class_stats(&snap, pool, nvroot);
+	snap.sn_pool_depth[pool] = pool_depth_limit(nvroot);
+	if (KGROUP_ON(KG_PROPS))
+		collect_pool_props(zhp);
+
+	/* when streaming, the vdev tree is walked later, once per family */
+	if (stream_output) {
+		snap.sn_zhp[pool] = zhp;
+		snap.sn_nvroot[pool] = nvroot;
+		return (0);
+	}
+	err = collect_recursive_stats(&snap, nvroot, pool, NULL, 0, VC_NONE);
+	zpool_close(zhp);
+	return (err);
+}
+
+
+/*
+ * kstats are read from a file descriptor that is kept open between
+ * collections, using pread() at offset 0, into a buffer that is also
+ * kept. The text is then tokenized in place: no stdio, no copies, and
+ * no allocations once the buffer is large enough.
+ */
+typedef struct kstat_file {
+	char		*kf_path;
+	int		kf_fd;
+	char		*kf_buf;
+	size_t		kf_bufsize;
+	size_t		kf_len;
+} kstat_file_t;
+
+/*
+ * Named kstats have two header lines followed by one "name type data"
+ * line per stat. A kstat_named_t describes a stat to export, the metric
+ * name is the prefix of the collector plus kn_metric.
+ */
+typedef struct kstat_named {
+	char		*kn_name;
+	char		*kn_metric;
+	char		*kn_help;
+	char		*kn_type;
+} kstat_named_t;
+
+typedef struct kstat_collector {
+	char		*kc_name;		/* for -K */
+	boolean_t	kc_enabled;
+	kstat_file_t	kc_file;
+	char		*kc_prefix;
+	kstat_named_t	*kc_named;
+	uint_t		kc_count;
+	uint64_t	*kc_val;
+	boolean_t	*kc_valid;
+	boolean_t	kc_collected;
+} kstat_collector_t;
+
+/*
+ * read the whole kstat, opening it if needed. On error, the descriptor is
+ * closed so that the next collection tries again, for example after the
+ * zfs module is reloaded.
+ */
+int
+kstat_read(kstat_file_t *kf) {
+	ssize_t n;
+
+	if (kf->kf_fd < 0 && (kf->kf_fd = open(kf->kf_path, O_RDONLY)) < 0)
+		return (-1);
+	if (kf->kf_buf == NULL) {
+		kf->kf_bufsize = KSTAT_BUFSIZE;
+		kf->kf_buf = xrealloc(NULL, kf->kf_bufsize);
+	}
+	kf->kf_len = 0;
+	for (;;) {
+		n = pread(kf->kf_fd, kf->kf_buf + kf->kf_len,
+		    kf->kf_bufsize - kf->kf_len - 1, kf->kf_len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			(void) close(kf->kf_fd);
+			kf->kf_fd = -1;
+			return (-1);
+		}
+		if (n == 0)
+			break;
+		kf->kf_len += n;
+		if (kf->kf_len == kf->kf_bufsize - 1) {
+			kf->kf_bufsize <<= 1;
+			kf->kf_buf = xrealloc(kf->kf_buf, kf->kf_bufsize);
+		}
+	}
+	kf->kf_buf[kf->kf_len] = '\0';
+	return (0);
+}
+
+void
+kstat_close(kstat_file_t *kf) {
+	if (kf->kf_fd >= 0)
+		(void) close(kf->kf_fd);
+	free(kf->kf_buf);
+	free(kf->kf_path);
+}
+
+/*
+ * zero-copy tokenizer: return the next blank separated token on the line
+ * starting at *pp, advancing *pp past it. At the end of the line, the
+ * length is 0 and *pp is left at the newline.
+ */
+char *
+kstat_token(char **pp, size_t *len) {
+	char *p = *pp, *t;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	t = p;
+	while (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\0')
+		p++;
+	*len = p - t;
+	*pp = p;
+	return (t);
+}
+
+/*
+ * skip to the start of the next line
+ */
+char *
+kstat_next_line(char *p) {
+	while (*p != '\n' && *p != '\0')
+		p++;
+	return (*p == '\n' ? p + 1 : p);
+}
+
+/*
+ * parse a decimal value, signed values are kept in two's complement
+ */
+uint64_t
+kstat_value(char *p, size_t len) {
+	uint64_t v = 0;
+	boolean_t neg = (len > 0 && *p == '-');
+
+	for (size_t i = neg ? 1 : 0; i < len && p[i] >= '0' && p[i] <= '9'; i++)
+		v = v * 10 + (p[i] - '0');
+	return (neg ? -v : v);
+}
+
+/*
+ * Find the descriptor for a stat name. The descriptors are listed in
+ * kstat order, so the one after the last match is tried first and a
+ * search is only needed if the kstat differs from what we expect.
+ */
+int
+kstat_named_find(kstat_named_t *kn, uint_t count, uint_t hint, char *name,
+                 size_t len) {
+	for (uint_t n = 0; n < count; n++, hint++) {
+		if (hint >= count)
+			hint = 0;
+		if (strncmp(kn[hint].kn_name, name, len) == 0 &&
+		    kn[hint].kn_name[len] == '\0')
+			return (hint);
+	}
+	return (-1);
+}
+
+/*
+ * read and parse a named kstat into the collector's values
+ */
+int
+kstat_collect_named(kstat_collector_t *kc) {
+	char *p, *name, *value;
+	size_t name_len, type_len, value_len;
+	uint_t hint = 0;
+	int i;
+
+	kc->kc_collected = B_FALSE;
+	if (kc->kc_val == NULL) {
+		kc->kc_val = xrealloc(NULL, kc->kc_count * sizeof (uint64_t));
+		kc->kc_valid = xrealloc(NULL,
+		    kc->kc_count * sizeof (boolean_t));
+	}
+	(void) memset(kc->kc_valid, 0, kc->kc_count * sizeof (boolean_t));
+	if (kstat_read(&kc->kc_file) != 0)
+		return (-1);
+
+	/* skip the kstat header and the column names */
+	p = kstat_next_line(kstat_next_line(kc->kc_file.kf_buf));
+	for (; *p != '\0'; p = kstat_next_line(p)) {
+		name = kstat_token(&p, &name_len);
+		(void) kstat_token(&p, &type_len);
+		value = kstat_token(&p, &value_len);
+		if (value_len == 0)
+			continue;
+		if ((i = kstat_named_find(kc->kc_named, kc->kc_count, hint,
+		    name, name_len)) < 0)
+			continue;
+		kc->kc_val[i] = kstat_value(value, value_len);
+		kc->kc_valid[i] = B_TRUE;
+		hint = i + 1;
+	}
+	kc->kc_collected = B_TRUE;
+	return (0);
+}
+
+void
+print_kstat_named(kstat_collector_t *kc) {
+	if (!kc->kc_collected)
+		return;
+	for (uint_t i = 0; i < kc->kc_count; i++) {
+		if (kc->kc_valid[i])
+			print_prom_u64(kc->kc_prefix, kc->kc_named[i].kn_metric,
+			    NULL, kc->kc_val[i], kc->kc_named[i].kn_help,
+			    kc->kc_named[i].kn_type);
+	}
+}
+
+/*
+ * ARC stats answer the question "is the ARC hitting?" They are not per
+ * pool, so there is no name label.
+ */
+kstat_named_t arc_named[] = {
+	{"hits",		"hits",		"ARC hits",	"counter"},
+	{"misses",		"misses",	"ARC misses",	"counter"},
+	{"demand_data_hits",	"demand_data_hits",
+	    "ARC demand data hits",			"counter"},
+	{"demand_data_misses",	"demand_data_misses",
+	    "ARC demand data misses",			"counter"},
+	{"demand_metadata_hits", "demand_metadata_hits",
+	    "ARC demand metadata hits",			"counter"},
+	{"demand_metadata_misses", "demand_metadata_misses",
+	    "ARC demand metadata misses",		"counter"},
+	{"prefetch_data_hits",	"prefetch_data_hits",
+	    "ARC prefetch data hits",			"counter"},
+	{"prefetch_data_misses", "prefetch_data_misses",
+	    "ARC prefetch data misses",			"counter"},
+	{"prefetch_metadata_hits", "prefetch_metadata_hits",
+	    "ARC prefetch metadata hits",		"counter"},
+	{"prefetch_metadata_misses", "prefetch_metadata_misses",
+	    "ARC prefetch metadata misses",		"counter"},
+	{"mru_hits",		"mru_hits",	"MRU list hits", "counter"},
+	{"mru_ghost_hits",	"mru_ghost_hits",
+	    "MRU ghost list hits",			"counter"},
+	{"mfu_hits",		"mfu_hits",	"MFU list hits", "counter"},
+	{"mfu_ghost_hits",	"mfu_ghost_hits",
+	    "MFU ghost list hits",			"counter"},
+	{"deleted",		"deleted",	"buffers evicted", "counter"},
+	{"mutex_miss",		"mutex_miss",
+	    "evictions skipped due to a held lock",	"counter"},
+	{"evict_skip",		"evict_skip",
+	    "evictions skipped due to I/O in progress",	"counter"},
+	{"p",			"p_bytes",	"MRU target size", "gauge"},
+	{"c",			"c_bytes",	"ARC target size", "gauge"},
+	{"c_min",		"c_min_bytes",	"ARC minimum size", "gauge"},
+	{"c_max",		"c_max_bytes",	"ARC maximum size", "gauge"},
+	{"size",		"size_bytes",	"ARC size",	"gauge"},
+	{"hdr_size",		"hdr_size_bytes",
+	    "ARC header size",				"gauge"},
+	{"data_size",		"data_size_bytes",
+	    "ARC data size",				"gauge"},
+	{"metadata_size",	"metadata_size_bytes",
+	    "ARC metadata size",			"gauge"},
+	{"mru_size",		"mru_size_bytes", "MRU list size", "gauge"},
+	{"mru_ghost_size",	"mru_ghost_size_bytes",
+	    "MRU ghost list size",			"gauge"},
+	{"mfu_size",		"mfu_size_bytes", "MFU list size", "gauge"},
+	{"mfu_ghost_size",	"mfu_ghost_size_bytes",
+	    "MFU ghost list size",			"gauge"},
+	{"l2_hits",		"l2_hits",	"L2ARC hits",	"counter"},
+	{"l2_misses",		"l2_misses",	"L2ARC misses",	"counter"},
+	{"l2_feeds",		"l2_feeds",
+	    "L2ARC feed thread iterations",		"counter"},
+	{"l2_rw_clash",		"l2_rw_clash",
+	    "L2ARC reads of buffers being written",	"counter"},
+	{"l2_read_bytes",	"l2_read_bytes", "L2ARC bytes read", "counter"},
+	{"l2_write_bytes",	"l2_write_bytes",
+	    "L2ARC bytes written",			"counter"},
+	{"l2_writes_sent",	"l2_writes_sent",
+	    "L2ARC writes issued",			"counter"},
+	{"l2_writes_done",	"l2_writes_done",
+	    "L2ARC writes completed",			"counter"},
+	{"l2_writes_error",	"l2_writes_error",
+	    "L2ARC write errors",			"counter"},
+	{"l2_evict_lock_retry",	"l2_evict_lock_retry",
+	    "L2ARC evictions retried on a held lock",	"counter"},
+	{"l2_evict_reading",	"l2_evict_reading",
+	    "L2ARC evictions of buffers being read",	"counter"},
+	{"l2_free_on_write",	"l2_free_on_write",
+	    "L2ARC buffers freed while being written",	"counter"},
+	{"l2_abort_lowmem",	"l2_abort_lowmem",
+	    "L2ARC writes aborted due to low memory",	"counter"},
+	{"l2_cksum_bad",	"l2_cksum_bad",
+	    "L2ARC checksum errors",			"counter"},
+	{"l2_io_error",		"l2_io_error",	"L2ARC I/O errors", "counter"},
+	{"l2_size",		"l2_size_bytes", "L2ARC size",	"gauge"},
+	{"l2_asize",		"l2_asize_bytes",
+	    "L2ARC allocated size",			"gauge"},
+	{"l2_hdr_size",		"l2_hdr_size_bytes",
+	    "L2ARC header size in the ARC",		"gauge"},
+	{"memory_throttle_count", "memory_throttle_count",
+	    "writes throttled due to low memory",	"counter"},
+	{"arc_meta_used",	"meta_used_bytes",
+	    "ARC metadata used",			"gauge"},
+	{"arc_meta_limit",	"meta_limit_bytes",
+	    "ARC metadata limit",			"gauge"},
+};
+
+kstat_named_t zil_named[] = {
+	{"zil_commit_count",	"commit_count",
+	    "zil_commit() calls",			"counter"},
+	{"zil_commit_writer_count", "commit_writer_count",
+	    "zil_commit() calls writing the ZIL",	"counter"},
+	{"zil_itx_count",	"itx_count",
+	    "ZIL transactions",				"counter"},
+	{"zil_itx_indirect_count", "itx_indirect_count",
+	    "ZIL transactions written indirectly",	"counter"},
+	{"zil_itx_indirect_bytes", "itx_indirect_bytes",
+	    "bytes written indirectly",			"counter"},
+	{"zil_itx_copied_count", "itx_copied_count",
+	    "ZIL transactions with copied data",	"counter"},
+	{"zil_itx_copied_bytes", "itx_copied_bytes",
+	    "bytes copied into ZIL transactions",	"counter"},
+	{"zil_itx_needcopy_count", "itx_needcopy_count",
+	    "ZIL transactions with data copied at commit", "counter"},
+	{"zil_itx_needcopy_bytes", "itx_needcopy_bytes",
+	    "bytes copied at commit",			"counter"},
+	{"zil_itx_metaslab_normal_count", "itx_metaslab_normal_count",
+	    "ZIL blocks in the normal class",		"counter"},
+	{"zil_itx_metaslab_normal_bytes", "itx_metaslab_normal_bytes",
+	    "ZIL bytes in the normal class",		"counter"},
+	{"zil_itx_metaslab_slog_count", "itx_metaslab_slog_count",
+	    "ZIL blocks on log devices",		"counter"},
+	{"zil_itx_metaslab_slog_bytes", "itx_metaslab_slog_bytes",
+	    "ZIL bytes on log devices",			"counter"},
+};
+
+kstat_named_t zfetch_named[] = {
+	{"hits",		"hits",		"prefetch stream hits", "counter"},
+	{"misses",		"misses",	"prefetch stream misses", "counter"},
+	{"max_streams",		"max_streams",
+	    "prefetch streams not created, at the limit", "counter"},
+	{"io_issued",		"io_issued",
+	    "prefetch I/Os issued",			"counter"},
+	{"io_active",		"io_active",
+	    "prefetch I/Os in progress",		"gauge"},
+};
+
+kstat_named_t dbuf_named[] = {
+	{"cache_count",		"cache_count",
+	    "dbufs in the dbuf cache",			"gauge"},
+	{"cache_size_bytes",	"cache_size_bytes",
+	    "dbuf cache size",				"gauge"},
+	{"cache_size_bytes_max", "cache_size_max_bytes",
+	    "largest dbuf cache size",			"gauge"},
+	{"cache_target_bytes",	"cache_target_bytes",
+	    "dbuf cache target size",			"gauge"},
+	{"cache_total_evicts",	"cache_evicts",
+	    "dbufs evicted from the dbuf cache",	"counter"},
+	{"hash_hits",		"hash_hits",	"dbuf hash hits", "counter"},
+	{"hash_misses",		"hash_misses",	"dbuf hash misses", "counter"},
+	{"hash_collisions",	"hash_collisions",
+	    "dbuf hash collisions",			"counter"},
+	{"hash_elements",	"hash_elements",
+	    "dbufs in the hash table",			"gauge"},
+	{"hash_chains",		"hash_chains",
+	    "dbuf hash chains longer than 1",		"gauge"},
+	{"hash_chain_max",	"hash_chain_max",
+	    "longest dbuf hash chain",			"gauge"},
+	{"hash_insert_race",	"hash_insert_race",
+	    "dbuf hash insertions lost to a race",	"counter"},
+	{"metadata_cache_count", "metadata_cache_count",
+	    "dbufs in the metadata cache",		"gauge"},
+	{"metadata_cache_size_bytes", "metadata_cache_size_bytes",
+	    "metadata cache size",			"gauge"},
+	{"metadata_cache_overflow", "metadata_cache_overflow",
+	    "metadata cache overflows",			"counter"},
+};
+
+kstat_named_t abd_named[] = {
+	{"struct_size",		"struct_size_bytes",
+	    "size of the abd structures",		"gauge"},
+	{"linear_cnt",		"linear_count",	"linear abds", "gauge"},
+	{"linear_data_size",	"linear_data_size_bytes",
+	    "data in linear abds",			"gauge"},
+	{"scatter_cnt",		"scatter_count", "scatter abds", "gauge"},
+	{"scatter_data_size",	"scatter_data_size_bytes",
+	    "data in scatter abds",			"gauge"},
+	{"scatter_chunk_waste",	"scatter_chunk_waste_bytes",
+	    "space lost at the end of scatter abds",	"gauge"},
+	{"scatter_page_multi_chunk", "scatter_page_multi_chunk",
+	    "scatter abds over several chunks",		"counter"},
+	{"scatter_page_multi_zone", "scatter_page_multi_zone",
+	    "scatter abds over several zones",		"counter"},
+	{"scatter_page_alloc_retry", "scatter_page_alloc_retry",
+	    "scatter page allocations retried",		"counter"},
+	{"scatter_sg_table_retry", "scatter_sg_table_retry",
+	    "scatter table allocations retried",	"counter"},
+};
+
+kstat_named_t dmu_tx_named[] = {
+	{"dmu_tx_assigned",	"assigned",
+	    "transactions assigned to a TXG",		"counter"},
+	{"dmu_tx_delay",	"delay",
+	    "transactions delayed",			"counter"},
+	{"dmu_tx_error",	"error",
+	    "transactions failed",			"counter"},
+	{"dmu_tx_suspended",	"suspended",
+	    "transactions waiting on a suspended pool",	"counter"},
+	{"dmu_tx_group",	"group",
+	    "transactions waiting for the next TXG",	"counter"},
+	{"dmu_tx_memory_reserve", "memory_reserve",
+	    "transactions waiting on ARC memory",	"counter"},
+	{"dmu_tx_memory_reclaim", "memory_reclaim",
+	    "transactions waiting on ARC eviction",	"counter"},
+	{"dmu_tx_dirty_throttle", "dirty_throttle",
+	    "transactions throttled by dirty data",	"counter"},
+	{"dmu_tx_dirty_delay",	"dirty_delay",
+	    "transactions delayed by dirty data",	"counter"},
+	{"dmu_tx_dirty_over_max", "dirty_over_max",
+	    "transactions waiting at the dirty data limit", "counter"},
+	{"dmu_tx_dirty_frees_delay", "dirty_frees_delay",
+	    "transactions delayed by pending frees",	"counter"},
+	{"dmu_tx_quota",	"quota",
+	    "transactions failed on quota",		"counter"},
+};
+
+#define	KSTAT_COLLECTOR(name, prefix, named, enabled) { \
+	.kc_name = name, \
+	.kc_enabled = enabled, \
+	.kc_file = { .kf_path = KSTAT_BASE "/" name, .kf_fd = -1 }, \
+	.kc_prefix = prefix, \
+	.kc_named = named, \
+	.kc_count = sizeof (named) / sizeof (named[0]), \
+}
+
+/*
+ * The global named kstats, only arcstats is read unless -K says otherwise
+ */
+kstat_collector_t named_stats[] = {
+	KSTAT_COLLECTOR("arcstats", ARC_MEASUREMENT, arc_named, B_TRUE),
+	KSTAT_COLLECTOR("zil", ZIL_MEASUREMENT, zil_named, B_FALSE),
+	KSTAT_COLLECTOR("zfetchstats", ZFETCH_MEASUREMENT, zfetch_named,
+	    B_FALSE),
+	KSTAT_COLLECTOR("dbufstats", DBUF_MEASUREMENT, dbuf_named, B_FALSE),
+	KSTAT_COLLECTOR("abdstats", ABD_MEASUREMENT, abd_named, B_FALSE),
+	KSTAT_COLLECTOR("dmu_tx", DMU_TX_STATS_MEASUREMENT, dmu_tx_named,
+	    B_FALSE),
+};
+#define	NAMED_STATS	(sizeof (named_stats) / sizeof (named_stats[0]))
+#define	ARC_STATS	(&named_stats[0])	/* arcstats is first */
+
+/*
+ * L2ARC rates, between the last two collections of arcstats, so they are
+ * only known in execd mode. The hit ratio is for the same interval, and
+ * unknown when there was no L2ARC lookup.
+ */
+typedef struct l2arc_rate {
+	char		*lr_counter;		/* in arc_named */
+	char		*lr_metric;
+	char		*lr_help;
+	int		lr_index;
+	uint64_t	lr_last;
+	double		lr_rate;		/* NAN if unknown */
+} l2arc_rate_t;
+
+l2arc_rate_t l2arc_rates[] = {
+	{"l2_hits",	"l2_hits_per_second",	"L2ARC hits per second"},
+	{"l2_misses",	"l2_misses_per_second",	"L2ARC misses per second"},
+	{"l2_feeds",	"l2_feeds_per_second",
+	    "L2ARC feed thread iterations per second"},
+	{"l2_read_bytes", "l2_read_bytes_per_second",
+	    "L2ARC bytes read per second"},
+	{"l2_write_bytes", "l2_write_bytes_per_second",
+	    "L2ARC bytes written per second"},
+};
+#define	L2ARC_RATES	(sizeof (l2arc_rates) / sizeof (l2arc_rates[0]))
+#define	L2ARC_HITS	0
+#define	L2ARC_MISSES	1
+
+double l2arc_time = 0;
+
+void
+l2arc_rates_update(kstat_collector_t *kc) {
+	l2arc_rate_t *lr;
+	struct timespec ts;
+	double now, dt;
+	uint64_t v;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec + ts.tv_nsec / 1e9;
+	dt = now - l2arc_time;
+	for (uint_t i = 0; i < L2ARC_RATES; i++) {
+		lr = &l2arc_rates[i];
+		lr->lr_rate = NAN;
+		if (l2arc_time == 0)
+			lr->lr_index = kstat_named_find(kc->kc_named,
+			    kc->kc_count, 0, lr->lr_counter,
+			    strlen(lr->lr_counter));
+		if (!kc->kc_collected || lr->lr_index < 0 ||
+		    !kc->kc_valid[lr->lr_index])
+			continue;
+		v = kc->kc_val[lr->lr_index];
+		if (l2arc_time != 0 && dt > 0 && v >= lr->lr_last)
+			lr->lr_rate = (v - lr->lr_last) / dt;
+		lr->lr_last = v;
+	}
+	l2arc_time = now;
+}
+
+void
+print_l2arc_rates(void) {
+	double hits = l2arc_rates[L2ARC_HITS].lr_rate;
+	double misses = l2arc_rates[L2ARC_MISSES].lr_rate;
+
+	if (l2arc_time == 0)
+		return;
+	for (uint_t i = 0; i < L2ARC_RATES; i++) {
+		if (!isnan(l2arc_rates[i].lr_rate))
+			print_prom_d(ARC_MEASUREMENT, l2arc_rates[i].lr_metric,
+			    NULL, l2arc_rates[i].lr_rate,
+			    l2arc_rates[i].lr_help, "gauge");
+	}
+	if (!isnan(hits) && !isnan(misses) && hits + misses > 0)
+		print_prom_d(ARC_MEASUREMENT, "l2_hit_ratio", NULL,
+		    hits / (hits + misses), "recent L2ARC hit ratio", "gauge");
+}
+
+/*
+ * enable the named kstats in a comma separated list, disabling the others
+ */
+int
+named_stats_enable(char *list) {
+	char *name, *last;
+	uint_t i;
+
+	for (i = 0; i < NAMED_STATS; i++)
+		named_stats[i].kc_enabled = B_FALSE;
+	for (name = strtok_r(list, ",", &last); name != NULL;
+	    name = strtok_r(NULL, ",", &last)) {
+		for (i = 0; i < NAMED_STATS; i++) {
+			if (strcmp(named_stats[i].kc_name, name) == 0)
+				break;
+		}
+		if (i == NAMED_STATS) {
+			fprintf(stderr, "error: unknown kstat %s\n", name);
+			return (-1);
+		}
+		named_stats[i].kc_enabled = B_TRUE;
+	}
+	return (0);
+}
+
+/*
+ * The txgs kstat is a ring of the most recent TXGs of a pool, one row per
+ * TXG, with the time spent in each state and the dirty data synced. Only
+ * rows for TXGs committed since the previous collection are parsed, and
+ * added to histograms kept here. So the histograms count every TXG seen
+ * since the collector started, as a prometheus histogram should, without
+ * the whole ring being exported each time.
+ *
+ * Sync times are bucketed in powers of 2 nanoseconds, from about 1ms to
+ * about 69s, dirty data in powers of 2 bytes, from 64KiB to 64GiB.
+ */
+#define	TXG_TIME_MIN_INDEX	20
+#define	TXG_TIME_BUCKETS	(VDEV_L_HISTO_BUCKETS - TXG_TIME_MIN_INDEX)
+#define	TXG_DIRTY_MIN_INDEX	16
+#define	TXG_DIRTY_BUCKETS	21
+#define	TXG_MAX_COLUMNS		16
+
+/*
+ * The dmu_tx_assign kstat is a histogram of the time transactions waited
+ * to be assigned to a TXG, which is where the write throttle delays them.
+ * Its row "<2^i> ns" counts waits of (2^(i-1), 2^i] ns since the pool was
+ * imported, so it is only copied, into the latency buckets from about 1us.
+ * The last row also counts all longer waits, so it goes to +Inf.
+ */
+#define	DMU_TX_MIN_INDEX	10
+
+typedef struct txg_pool {
+	char		*tp_name;
+	char		*tp_label;		/* escaped pool name */
+	kstat_file_t	tp_file;
+	boolean_t	tp_seen;		/* in this collection */
+	boolean_t	tp_present;		/* for txg_pools_prune() */
+	uint64_t	tp_last_txg;		/* last committed txg parsed */
+	uint64_t	tp_count;
+	uint64_t	tp_sync[TXG_TIME_BUCKETS + 1];	/* last is +Inf */
+	uint64_t	tp_sync_ns;
+	uint64_t	tp_dirty[TXG_DIRTY_BUCKETS + 1];
+	uint64_t	tp_dirty_bytes;
+	kstat_file_t	tp_assign_file;
+	boolean_t	tp_assign_seen;
+	uint64_t	tp_assign[VDEV_L_HISTO_BUCKETS + 1];	/* last is +Inf */
+	uint64_t	tp_assign_count;
+} txg_pool_t;
+
+txg_pool_t *txg_pools = NULL;
+uint_t txg_npools = 0;
+histo_names_t txg_sync_names;
+histo_names_t txg_dirty_names;
+histo_names_t dmu_tx_names;
+char *txg_dirty_le[TXG_DIRTY_BUCKETS];
+
+/*
+ * index of the smallest power of 2 bucket holding v, between min and
+ * min + buckets, the latter being +Inf
+ */
+uint_t
+txg_bucket(uint64_t v, uint_t min, uint_t buckets) {
+	uint_t j = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1);
+
+	if (j < min)
+		return (0);
+	return (j - min < buckets ? j - min : buckets);
+}
+
+txg_pool_t *
+txg_pool_lookup(char *pool_name) {
+	txg_pool_t *tp;
+
+	for (uint_t i = 0; i < txg_npools; i++) {
+		if (strcmp(txg_pools[i].tp_name, pool_name) == 0)
+			return (&txg_pools[i]);
+	}
+	txg_pools = xrealloc(txg_pools, (txg_npools + 1) * sizeof (txg_pool_t));
+	tp = &txg_pools[txg_npools++];
+	(void) memset(tp, 0, sizeof (*tp));
+	tp->tp_name = xasprintf("%s", pool_name);
+	tp->tp_label = escape_label(pool_name);
+	tp->tp_file.kf_path = xasprintf(KSTAT_BASE "/%s/txgs", pool_name);
+	tp->tp_file.kf_fd = -1;
+	tp->tp_assign_file.kf_path = xasprintf(KSTAT_BASE "/%s/dmu_tx_assign",
+	    pool_name);
+	tp->tp_assign_file.kf_fd = -1;
+	return (tp);
+}
+
+/*
+ * column of a name in the kstat header line, or -1
+ */
+int
+txg_column(char *header, char *name) {
+	char *p = header, *t;
+	size_t len;
+
+	for (int col = 0; ; col++) {
+		t = kstat_token(&p, &len);
+		if (len == 0)
+			return (-1);
+		if (len == strlen(name) && strncmp(t, name, len) == 0)
+			return (col);
+	}
+}
+
+void
+txg_collect(char *pool_name) {
+	txg_pool_t *tp = txg_pool_lookup(pool_name);
+	char *p, *header, *tok[TXG_MAX_COLUMNS];
+	size_t len[TXG_MAX_COLUMNS];
+	int c_txg, c_state, c_dirty, c_stime, ncols;
+	uint64_t txg, max_txg = 0, v;
+
+	tp->tp_present = B_TRUE;
+	tp->tp_seen = B_FALSE;
+	if (kstat_read(&tp->tp_file) != 0)
+		return;
+	tp->tp_seen = B_TRUE;
+
+	header = kstat_next_line(tp->tp_file.kf_buf);
+	c_txg = txg_column(header, "txg");
+	c_state = txg_column(header, "state");
+	c_dirty = txg_column(header, "ndirty");
+	c_stime = txg_column(header, "stime");
+	if (c_txg != 0 || c_state < 0 || c_dirty < 0 || c_stime < 0 ||
+	    c_state >= TXG_MAX_COLUMNS || c_dirty >= TXG_MAX_COLUMNS ||
+	    c_stime >= TXG_MAX_COLUMNS)
+		return;
+
+	for (p = kstat_next_line(header); *p != '\0'; p = kstat_next_line(p)) {
+		tok[0] = kstat_token(&p, &len[0]);
+		if (len[0] == 0)
+			continue;
+		txg = kstat_value(tok[0], len[0]);
+		if (txg > max_txg)
+			max_txg = txg;
+		/* already seen, most rows are skipped here */
+		if (txg <= tp->tp_last_txg)
+			continue;
+		for (ncols = 1; ncols < TXG_MAX_COLUMNS; ncols++) {
+			tok[ncols] = kstat_token(&p, &len[ncols]);
+			if (len[ncols] == 0)
+				break;
+		}
+		if (ncols <= c_state || ncols <= c_dirty || ncols <= c_stime)
+			continue;
+		/* TXGs still open, quiescing, or syncing are parsed later */
+		if (len[c_state] != 1 || *tok[c_state] != 'C')
+			continue;
+
+		v = kstat_value(tok[c_stime], len[c_stime]);
+		tp->tp_sync[txg_bucket(v, TXG_TIME_MIN_INDEX,
+		    TXG_TIME_BUCKETS)]++;
+		tp->tp_sync_ns += v;
+		v = kstat_value(tok[c_dirty], len[c_dirty]);
+		tp->tp_dirty[txg_bucket(v, TXG_DIRTY_MIN_INDEX,
+		    TXG_DIRTY_BUCKETS)]++;
+		tp->tp_dirty_bytes += v;
+		tp->tp_count++;
+		tp->tp_last_txg = txg;
+	}
+	/* the pool was recreated: start over at its first txg */
+	if (max_txg < tp->tp_last_txg)
+		tp->tp_last_txg = 0;
+}
+
+void
+dmu_tx_collect(char *pool_name) {
+	txg_pool_t *tp = txg_pool_lookup(pool_name);
+	char *p, *name, *value;
+	size_t name_len, len, value_len;
+	uint64_t ns, v, last_v = 0;
+	uint_t j, last_j = VDEV_L_HISTO_BUCKETS;
+
+	tp->tp_present = B_TRUE;
+	tp->tp_assign_seen = B_FALSE;
+	if (kstat_read(&tp->tp_assign_file) != 0)
+		return;
+	tp->tp_assign_seen = B_TRUE;
+	(void) memset(tp->tp_assign, 0, sizeof (tp->tp_assign));
+	tp->tp_assign_count = 0;
+
+	/* skip the kstat header and the column names */
+	p = kstat_next_line(kstat_next_line(tp->tp_assign_file.kf_buf));
+	for (; *p != '\0'; p = kstat_next_line(p)) {
+		/* "<ns> ns <type> <count>" */
+		name = kstat_token(&p, &name_len);
+		(void) kstat_token(&p, &len);
+		(void) kstat_token(&p, &len);
+		value = kstat_token(&p, &value_len);
+		if (value_len == 0)
+			continue;
+		ns = kstat_value(name, name_len);
+		if (ns == 0 || (ns & (ns - 1)) != 0)
+			continue;
+		/* the row is its upper bound, beyond the last finite le */
+		j = __builtin_ctzll(ns);
+		if (j < DMU_TX_MIN_INDEX)
+			j = DMU_TX_MIN_INDEX;
+		else if (j > VDEV_L_HISTO_BUCKETS)
+			j = VDEV_L_HISTO_BUCKETS;
+		v = kstat_value(value, value_len);
+		tp->tp_assign[j] += v;
+		tp->tp_assign_count += v;
+		last_j = j;
+		last_v = v;
+	}
+	tp->tp_assign[last_j] -= last_v;
+	tp->tp_assign[VDEV_L_HISTO_BUCKETS] += last_v;
+}
+
+/*
+ * drop the pools whose kstat directory was not found in the last walk
+ */
+void
+txg_pools_prune(void) {
+	txg_pool_t *tp;
+	uint_t i, n = 0;
+
+	for (i = 0; i < txg_npools; i++) {
+		tp = &txg_pools[i];
+		if (!tp->tp_present) {
+			kstat_close(&tp->tp_file);
+			kstat_close(&tp->tp_assign_file);
+			free(tp->tp_name);
+			free(tp->tp_label);
+			continue;
+		}
+		tp->tp_present = B_FALSE;
+		txg_pools[n++] = *tp;
+	}
+	txg_npools = n;
+}
+
+void
+print_txg_sample(char *metric, char *pool_label, char *le, uint64_t value) {
+	(void) fputs(metric, stdout);
+	(void) fputs("{name=\"", stdout);
+	(void) fputs(pool_label, stdout);
+	(void) fputc('"', stdout);
+	(void) fputs(le, stdout);
+	print_value_u64(value);
+}
+
+void
+print_txg_stats(void) {
+	txg_pool_t *tp;
+	uint64_t sum;
+	uint_t i, j;
+
+	if (txg_npools == 0)
+		return;
+	if (KFAMILY_ON(KG_TXG, 0)) {
+		print_kfamily_header(KG_TXG, 0);
+		for (i = 0, tp = txg_pools; i < txg_npools; i++, tp++) {
+			if (!tp->tp_seen)
+				continue;
+			for (j = 0, sum = 0; j < TXG_TIME_BUCKETS; j++)
+				print_txg_sample(txg_sync_names.bucket,
+				    tp->tp_label, lat_le[j + TXG_TIME_MIN_INDEX],
+				    sum += tp->tp_sync[j]);
+			print_txg_sample(txg_sync_names.bucket, tp->tp_label,
+			    inf_le, tp->tp_count);
+			(void) printf("%s{name=\"%s\"} %"PRIu64".%09"PRIu64"\n",
+			    txg_sync_names.sum, tp->tp_label,
+			    tp->tp_sync_ns / 1000000000,
+			    tp->tp_sync_ns % 1000000000);
+			print_txg_sample(txg_sync_names.count, tp->tp_label,
+			    no_le, tp->tp_count);
+		}
+	}
+	if (KFAMILY_ON(KG_TXG, 1)) {
+		print_kfamily_header(KG_TXG, 1);
+		for (i = 0, tp = txg_pools; i < txg_npools; i++, tp++) {
+			if (!tp->tp_seen)
+				continue;
+			for (j = 0, sum = 0; j < TXG_DIRTY_BUCKETS; j++)
+				print_txg_sample(txg_dirty_names.bucket,
+				    tp->tp_label, txg_dirty_le[j],
+				    sum += tp->tp_dirty[j]);
+			print_txg_sample(txg_dirty_names.bucket, tp->tp_label,
+			    inf_le, tp->tp_count);
+			print_txg_sample(txg_dirty_names.sum, tp->tp_label,
+			    no_le, tp->tp_dirty_bytes);
+			print_txg_sample(txg_dirty_names.count, tp->tp_label,
+			    no_le, tp->tp_count);
+		}
+	}
+
+	/* only the counts are kept by the kernel, so the sum is 0 */
+	if (KFAMILY_ON(KG_DMU_TX, 0)) {
+		print_kfamily_header(KG_DMU_TX, 0);
+		for (i = 0, tp = txg_pools; i < txg_npools; i++, tp++) {
+			if (!tp->tp_assign_seen)
+				continue;
+			for (j = DMU_TX_MIN_INDEX, sum = 0;
+			    j < VDEV_L_HISTO_BUCKETS; j++)
+				print_txg_sample(dmu_tx_names.bucket,
+				    tp->tp_label, lat_le[j],
+				    sum += tp->tp_assign[j]);
+			print_txg_sample(dmu_tx_names.bucket, tp->tp_label,
+			    inf_le, tp->tp_assign_count);
+			print_txg_sample(dmu_tx_names.sum, tp->tp_label, no_le,
+			    0);
+			print_txg_sample(dmu_tx_names.count, tp->tp_label,
+			    no_le, tp->tp_assign_count);
+		}
+	}
+	for (i = 0, tp = txg_pools; i < txg_npools; i++, tp++) {
+		tp->tp_seen = B_FALSE;
+		tp->tp_assign_seen = B_FALSE;
+	}
+}
+
+/*
+ * Each dataset has an objset-0x<id> kstat in its pool's kstat directory,
+ * with its name and I/O counters. Pools can have thousands of datasets,
+ * so the per-collection cost is kept to one pread() per dataset:
+ *
+ * - the directory is only listed again when it looks changed, when a
+ *   dataset's kstat cannot be read, or every OBJSET_RESCAN_SECS as a
+ *   backstop, since procfs directories do not reliably update their times
+ * - datasets are kept sorted by objset id, and their escaped names are
+ *   cached, so only a renamed dataset costs an allocation
+ * - all datasets share one read buffer, and at most OBJSET_MAX_OPEN kstats
+ *   per pool are held open, the others are opened for each read
+ */
+#define	OBJSET_RESCAN_SECS	60
+#define	OBJSET_MAX_OPEN		256
+#define	OBJSET_PREFIX		"objset-0x"
+
+kstat_named_t objset_named[] = {
+	{"writes",	"writes",	"dataset write operations", "counter"},
+	{"nwritten",	"written_bytes", "dataset bytes written", "counter"},
+	{"reads",	"reads",	"dataset read operations", "counter"},
+	{"nread",	"read_bytes",	"dataset bytes read",	"counter"},
+	{"nunlinks",	"unlinks",	"files queued for unlink", "counter"},
+	{"nunlinked",	"unlinked",	"files unlinked",	"counter"},
+};
+#define	OBJSET_STATS	(sizeof (objset_named) / sizeof (objset_named[0]))
+
+typedef struct objset {
+	uint64_t	os_id;
+	int		os_fd;
+	boolean_t	os_valid;		/* read in this collection */
+	char		*os_name;		/* as in the kstat */
+	char		*os_label;		/* escaped name */
+	uint64_t	os_val[OBJSET_STATS];
+} objset_t;
+
+typedef struct objset_pool {
+	char		*op_name;
+	char		*op_label;		/* escaped pool name */
+	char		*op_dir;
+	boolean_t	op_seen;		/* in this collection */
+	boolean_t	op_present;		/* for objset_pools_prune() */
+	struct timespec	op_mtime;		/* of op_dir, at the last scan */
+	time_t		op_scanned;
+	boolean_t	op_rescan;
+	objset_t	*op_objsets;		/* sorted by os_id */
+	uint_t		op_count;
+	uint_t		op_alloc;
+} objset_pool_t;
+
+objset_pool_t *objset_pools = NULL;
+uint_t objset_npools = 0;
+kstat_file_t objset_buf = { .kf_fd = -1 };	/* shared read buffer */
+
+objset_pool_t *
+objset_pool_lookup(char *pool_name) {
+	objset_pool_t *op;
+
+	for (uint_t i = 0; i < objset_npools; i++) {
+		if (strcmp(objset_pools[i].op_name, pool_name) == 0)
+			return (&objset_pools[i]);
+	}
+	objset_pools = xrealloc(objset_pools,
+	    (objset_npools + 1) * sizeof (objset_pool_t));
+	op = &objset_pools[objset_npools++];
+	(void) memset(op, 0, sizeof (*op));
+	op->op_name = xasprintf("%s", pool_name);
+	op->op_label = escape_label(pool_name);
+	op->op_dir = xasprintf(KSTAT_BASE "/%s", pool_name);
+	op->op_rescan = B_TRUE;
+	return (op);
+}
+
+int
+objset_compare(const void *a, const void *b) {
+	uint64_t x = ((const objset_t *)a)->os_id;
+	uint64_t y = ((const objset_t *)b)->os_id;
+
+	return (x < y ? -1 : x > y);
+}
+
+objset_t *
+objset_find(objset_pool_t *op, uint64_t id) {
+	objset_t key = { .os_id = id };
+
+	return (bsearch(&key, op->op_objsets, op->op_count, sizeof (objset_t),
+	    objset_compare));
+}
+
+void
+objset_close(objset_t *os) {
+	if (os->os_fd >= 0)
+		(void) close(os->os_fd);
+	free(os->os_name);
+	free(os->os_label);
+}
+
+/*
+ * List the pool's kstat directory again. Datasets still present keep
+ * their descriptors and names, new ones are added, and destroyed ones
+ * are dropped.
+ */
+void
+objset_scan(objset_pool_t *op, struct stat *st) {
+	DIR *dir;
+	struct dirent *de;
+	objset_t *os, *old = op->op_objsets;
+	uint_t nold = op->op_count, n = 0;
+	char *end;
+	uint64_t id;
+
+	op->op_rescan = B_FALSE;
+	op->op_scanned = time(NULL);
+	op->op_mtime = st->st_mtim;
+	if ((dir = opendir(op->op_dir)) == NULL)
+		return;
+
+	/* the old entries are found in the old array while the new is built */
+	op->op_objsets = NULL;
+	op->op_count = op->op_alloc = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, OBJSET_PREFIX,
+		    strlen(OBJSET_PREFIX)) != 0)
+			continue;
+		id = strtoull(de->d_name + strlen(OBJSET_PREFIX), &end, 16);
+		if (*end != '\0')
+			continue;
+		if (n == op->op_alloc) {
+			op->op_alloc = op->op_alloc ? op->op_alloc << 1 : 16;
+			op->op_objsets = xrealloc(op->op_objsets,
+			    op->op_alloc * sizeof (objset_t));
+		}
+		os = &op->op_objsets[n++];
+		(void) memset(os, 0, sizeof (*os));
+		os->os_id = id;
+		os->os_fd = -1;
+	}
+	(void) closedir(dir);
+	op->op_count = n;
+	qsort(op->op_objsets, n, sizeof (objset_t), objset_compare);
+
+	/* carry over what is known about the datasets that remain */
+	for (uint_t i = 0; i < nold; i++) {
+		if ((os = objset_find(op, old[i].os_id)) != NULL) {
+			*os = old[i];
+			continue;
+		}
+		objset_close(&old[i]);
+	}
+	free(old);
+
+	/* limit the descriptors held open */
+	for (uint_t i = OBJSET_MAX_OPEN; i < n; i++) {
+		os = &op->op_objsets[i];
+		if (os->os_fd >= 0) {
+			(void) close(os->os_fd);
+			os->os_fd = -1;
+		}
 	}
-	return (vdev_name);
 }
 
 /*
- * get a string suitable for prometheus label that describes this vdev
- *
- * By default only the vdev hierarchical name is shown, separated by '/'
- * If the vdev has an associated path, which is typical of leaf vdevs,
- * then the path is added.
- * It would be nice to have the devid instead of the path, but under
- * Linux we cannot be sure a devid will exist and we'd rather have
- * something than nothing, so we'll use path instead.
+ * read one dataset's kstat into os, returning nonzero if it is gone
  */
-char *
-get_vdev_desc(nvlist_t *nvroot, const char *parent_name) {
-	char vdev_desc[256];
-	char *vdev_type = NULL;
-	uint64_t vdev_id = 0;
-	char vdev_value[256];
-	char *vdev_path = NULL;
-	char vdev_path_value[256];
-	static char res[512];
+int
+objset_read(objset_pool_t *op, objset_t *os, boolean_t keep_open) {
+	char path[PATH_MAX], *p, *name, *value;
+	size_t name_len, type_len, value_len;
+	uint_t hint = 0;
+	int i;
 
-	if (nvlist_lookup_string(nvroot, ZPOOL_CONFIG_TYPE, &vdev_type) != 0) {
-		vdev_type = "unknown";
-	}
-	if (nvlist_lookup_uint64(nvroot, ZPOOL_CONFIG_ID, &vdev_id) != 0) {
-		vdev_id = -1ULL;
-	}
-	if (nvlist_lookup_string(
-	    nvroot, ZPOOL_CONFIG_PATH, &vdev_path) != 0) {
-		vdev_path = NULL;
+	os->os_valid = B_FALSE;
+	if (os->os_fd < 0)
+		(void) snprintf(path, sizeof (path), "%s/" OBJSET_PREFIX "%"PRIx64,
+		    op->op_dir, os->os_id);
+	objset_buf.kf_path = path;
+	objset_buf.kf_fd = os->os_fd;
+	i = kstat_read(&objset_buf);
+	os->os_fd = objset_buf.kf_fd;
+	if (i != 0)
+		return (-1);
+	if (!keep_open) {
+		(void) close(os->os_fd);
+		os->os_fd = -1;
 	}
 
-	if (parent_name == NULL) {
-		(void) snprintf(vdev_value, sizeof(vdev_value), "vdev=\"%s\"",
-		    vdev_type);
-	} else {
-		(void) snprintf(vdev_value, sizeof(vdev_value),
-		    "vdev=\"%s/%s-%"PRIu64"\"",
-		    parent_name, vdev_type, vdev_id);
+	p = kstat_next_line(kstat_next_line(objset_buf.kf_buf));
+	for (; *p != '\0'; p = kstat_next_line(p)) {
+		name = kstat_token(&p, &name_len);
+		(void) kstat_token(&p, &type_len);
+		value = kstat_token(&p, &value_len);
+		if (value_len == 0)
+			continue;
+		if (name_len == strlen("dataset_name") &&
+		    strncmp(name, "dataset_name", name_len) == 0) {
+			/* names may contain blanks: take the rest of the line */
+			value_len = strcspn(value, "\n");
+			if (os->os_name != NULL &&
+			    strncmp(os->os_name, value, value_len) == 0 &&
+			    os->os_name[value_len] == '\0')
+				continue;
+			free(os->os_name);
+			free(os->os_label);
+			os->os_name = xasprintf("%.*s", (int)value_len, value);
+			os->os_label = escape_label(os->os_name);
+			continue;
+		}
+		if ((i = kstat_named_find(objset_named, OBJSET_STATS, hint,
+		    name, name_len)) < 0)
+			continue;
+		os->os_val[i] = kstat_value(value, value_len);
+		hint = i + 1;
 	}
-	if (vdev_path == NULL) {
-		vdev_path_value[0] = '\0';
-	} else {
-		(void) snprintf(vdev_path_value, sizeof(vdev_path_value),
-		    ",path=\"%s\"", vdev_path);
+	os->os_valid = (os->os_label != NULL);
+	return (0);
+}
+
+void
+objset_collect(char *pool_name) {
+	objset_pool_t *op = objset_pool_lookup(pool_name);
+	struct stat st;
+
+	op->op_present = B_TRUE;
+	op->op_seen = B_FALSE;
+	if (stat(op->op_dir, &st) != 0)
+		return;
+	op->op_seen = B_TRUE;
+	if (op->op_rescan ||
+	    st.st_mtim.tv_sec != op->op_mtime.tv_sec ||
+	    st.st_mtim.tv_nsec != op->op_mtime.tv_nsec ||
+	    time(NULL) - op->op_scanned >= OBJSET_RESCAN_SECS)
+		objset_scan(op, &st);
+
+	for (uint_t i = 0; i < op->op_count; i++) {
+		/* destroyed since the last scan, look again next time */
+		if (objset_read(op, &op->op_objsets[i],
+		    i < OBJSET_MAX_OPEN) != 0)
+			op->op_rescan = B_TRUE;
 	}
-	(void) snprintf(res, sizeof(res), "%s%s", vdev_value, vdev_path_value);
-	return (res);
 }
 
 /*
- * vdev latency stats are histograms stored as nvlist arrays of uint64.
- * Latency stats include the ZIO scheduler classes plus lower-level
- * vdev latencies.
- *
- * In many cases, the top-level "root" view obscures the underlying
- * top-level vdev operations. For example, if a pool has a log, special,
- * or cache device, then each can behave very differently. It is useful
- * to see how each is responding.
+ * drop the pools whose kstat directory was not found in the last walk,
+ * closing the descriptors of their datasets
  */
-int
-print_vdev_latency_stats(nvlist_t *nvroot, const char *pool_name,
-                         const char *parent_name) {
-	uint_t c, end;
-	nvlist_t *nv, *nv_ex;
-	uint64_t *lat_array;
-	uint64_t sum;
-	char *p = POOL_LATENCY_MEASUREMENT;
-	char s[2 * ZFS_MAX_DATASET_NAME_LEN];
-	char t[2 * ZFS_MAX_DATASET_NAME_LEN];
-	char metric_name[2 * ZFS_MAX_DATASET_NAME_LEN];
-	char *vdev_desc = NULL;
-
-	/* short_names become part of the metric name */
-	struct lat_lookup {
-		char *name;
-		char *short_name;
-	};
-	struct lat_lookup lat_type[] = {
-		{ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO,	"total_read"},
-		{ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO,	"total_write"},
-		{ZPOOL_CONFIG_VDEV_DISK_R_LAT_HISTO,	"disk_read"},
-		{ZPOOL_CONFIG_VDEV_DISK_W_LAT_HISTO,	"disk_write"},
-		{ZPOOL_CONFIG_VDEV_SYNC_R_LAT_HISTO,	"sync_read"},
-		{ZPOOL_CONFIG_VDEV_SYNC_W_LAT_HISTO,	"sync_write"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_R_LAT_HISTO,	"async_read"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_W_LAT_HISTO,	"async_write"},
-		{ZPOOL_CONFIG_VDEV_SCRUB_LAT_HISTO,	"scrub"},
-#ifdef ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO
-		{ZPOOL_CONFIG_VDEV_TRIM_LAT_HISTO,	"trim"},
-#endif
-		{NULL,					NULL}
-	};
+void
+objset_pools_prune(void) {
+	objset_pool_t *op;
+	uint_t i, j, n = 0;
 
-	if (nvlist_lookup_nvlist(nvroot,
-	    ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
-		return (6);
+	for (i = 0; i < objset_npools; i++) {
+		op = &objset_pools[i];
+		if (!op->op_present) {
+			for (j = 0; j < op->op_count; j++)
+				objset_close(&op->op_objsets[j]);
+			free(op->op_objsets);
+			free(op->op_name);
+			free(op->op_label);
+			free(op->op_dir);
+			continue;
+		}
+		op->op_present = B_FALSE;
+		objset_pools[n++] = *op;
 	}
+	objset_npools = n;
+}
 
-	vdev_desc = get_vdev_desc(nvroot, parent_name);
+void
+print_objset_stats(void) {
+	char *metric_name;
+	objset_pool_t *op;
+	objset_t *os;
 
-	for (int i = 0; lat_type[i].name; i++) {
-		if (nvlist_lookup_uint64_array(nv_ex,
-		    lat_type[i].name, (uint64_t **) &lat_array, &c) != 0) {
-			fprintf(stderr, "error: can't get %s\n",
-			    lat_type[i].name);
-			return (3);
-		}
-		/* count */
-		sum = 0;
-		end = c - 1;
-		(void) snprintf(metric_name, sizeof(metric_name),
-		  "%s_%s_seconds", p, lat_type[i].name);
-		print_help_type(metric_name, "latency distribution",
-		    "histogram");
-
-		for (int j = 0; j <= end; j++) {
-			sum += lat_array[j];
-			(void) snprintf(s, sizeof(s),
-			    "%s_seconds_bucket", lat_type[i].name);
-
-			if (j >= MIN_LAT_INDEX && j < end) {
-				(void) snprintf(t, sizeof(t),
-				    "name=\"%s\",%s,le=\"%0.6f\"",
-				    pool_name, vdev_desc,
-				    (float) (1ULL << j) * 1e-9);
-				print_prom_u64(p, s, t, sum,
-				    NULL, NULL);
-			}
-			if (j == end) {
-				(void) snprintf(t, sizeof(t),
-				    "name=\"%s\",%s,le=\"+Inf\"",
-				    pool_name, vdev_desc);
-				print_prom_u64(p, s, t, sum,
-				    NULL, NULL);
-
-				/* TODO: zpool code update to include sum */
-				(void) snprintf(s, sizeof(s),
-				    "%s_seconds_sum", lat_type[i].name);
-				(void) snprintf(t, sizeof(t),
-				    "name=\"%s\",%s",
-				    pool_name, vdev_desc);
-				print_prom_u64(p, s, t, 0, NULL, NULL);
-
-				(void) snprintf(s, sizeof(s),
-				    "%s_seconds_count", lat_type[i].name);
-				print_prom_u64(p, s, t, sum, NULL, NULL);
+	if (objset_npools == 0)
+		return;
+	for (uint_t s = 0; s < OBJSET_STATS; s++) {
+		if (!KFAMILY_ON(KG_DATASET, s))
+			continue;
+		metric_name = families[KFAMILY_ID(KG_DATASET, s)].fd_name;
+		print_kfamily_header(KG_DATASET, s);
+		for (uint_t i = 0; i < objset_npools; i++) {
+			op = &objset_pools[i];
+			if (!op->op_seen)
+				continue;
+			for (uint_t j = 0; j < op->op_count; j++) {
+				os = &op->op_objsets[j];
+				if (!os->os_valid)
+					continue;
+				(void) printf("%s{name=\"%s\",dataset=\"%s\"} ",
+				    metric_name, op->op_label, os->os_label);
+				print_value_u64(os->os_val[s]);
 			}
 		}
 	}
-	return (0);
+	for (uint_t i = 0; i < objset_npools; i++)
+		objset_pools[i].op_seen = B_FALSE;
 }
 
 /*
- * vdev request size stats are histograms stored as nvlist arrays of uint64.
- * Request size stats include the ZIO scheduler classes plus lower-level
- * vdev sizes. Both independent (ind) and aggregated (agg) sizes are reported.
- *
- * In many cases, the top-level "root" view obscures the underlying
- * top-level vdev operations. For example, if a pool has a log, special,
- * or cache device, then each can behave very differently. It is useful
- * to see how each is responding.
+ * Newer OpenZFS has a per-pool iostats kstat, with counters not found in
+ * the pool config, such as TRIM, and no spa_config lock is taken to read
+ * it. Its counters vary between releases, so rather than a fixed table,
+ * every unsigned counter found is exported, as zpool_iostats_<name>.
+ * The descriptors are shared by all pools and only grow, as new names
+ * are seen.
  */
-int
-print_vdev_size_stats(nvlist_t *nvroot, const char *pool_name,
-			 const char *parent_name) {
-	uint_t c, end;
-	nvlist_t *nv, *nv_ex;
-	uint64_t *size_array;
-	uint64_t sum;
-	char *p = POOL_IO_SIZE_MEASUREMENT;
-	char s[2 * ZFS_MAX_DATASET_NAME_LEN];
-	char t[2 * ZFS_MAX_DATASET_NAME_LEN];
-	char metric_name[2 * ZFS_MAX_DATASET_NAME_LEN];
-	char *vdev_desc = NULL;
-
-	/* short_names become part of the metric name */
-	struct size_lookup {
-	char *name;
-	char *short_name;
-	};
-	struct size_lookup size_type[] = {
-		{ZPOOL_CONFIG_VDEV_SYNC_IND_R_HISTO,	"sync_read_ind"},
-		{ZPOOL_CONFIG_VDEV_SYNC_IND_W_HISTO,	"sync_write_ind"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_IND_R_HISTO,	"async_read_ind"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_IND_W_HISTO,	"async_write_ind"},
-		{ZPOOL_CONFIG_VDEV_IND_SCRUB_HISTO,	"scrub_read_ind"},
-		{ZPOOL_CONFIG_VDEV_SYNC_AGG_R_HISTO,	"sync_read_agg"},
-		{ZPOOL_CONFIG_VDEV_SYNC_AGG_W_HISTO,	"sync_write_agg"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_AGG_R_HISTO,	"async_read_agg"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_AGG_W_HISTO,	"async_write_agg"},
-		{ZPOOL_CONFIG_VDEV_AGG_SCRUB_HISTO,	"scrub_read_agg"},
-#ifdef ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO
-		{ZPOOL_CONFIG_VDEV_IND_TRIM_HISTO,	"trim_write_ind"},
-		{ZPOOL_CONFIG_VDEV_AGG_TRIM_HISTO,	"trim_write_agg"},
-#endif
-		{NULL,					NULL}
-	};
+#define	KSTAT_DATA_UINT64_TYPE	4
 
-	if (nvlist_lookup_nvlist(nvroot,
-		ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
-	return (6);
+kstat_named_t *iostats_named = NULL;
+uint_t iostats_nnamed = 0;
+
+/*
+ * Older releases have the pool I/O counters in the legacy io kstat
+ * instead, a line of column names and a line of values. It is read when
+ * present, so that -k has the pool I/O on those too.
+ */
+kstat_named_t io_named[] = {
+	{"nread",	"read_bytes",	"pool bytes read",	"counter"},
+	{"nwritten",	"written_bytes", "pool bytes written",	"counter"},
+	{"reads",	"reads",	"pool read operations",	"counter"},
+	{"writes",	"writes",	"pool write operations", "counter"},
+};
+#define	IO_STATS	(sizeof (io_named) / sizeof (io_named[0]))
+
+typedef struct iostats_pool {
+	char		*ip_name;
+	char		*ip_label;		/* escaped pool name */
+	kstat_file_t	ip_file;
+	boolean_t	ip_seen;		/* in this collection */
+	boolean_t	ip_present;		/* for iostats_pools_prune() */
+	uint_t		ip_alloc;
+	uint64_t	*ip_val;		/* indexed as iostats_named */
+	boolean_t	*ip_valid;
+	kstat_file_t	ip_io_file;
+	boolean_t	ip_io_seen;
+	uint64_t	ip_io[IO_STATS];
+} iostats_pool_t;
+
+iostats_pool_t *iostats_pools = NULL;
+uint_t iostats_npools = 0;
+
+iostats_pool_t *
+iostats_pool_lookup(char *pool_name) {
+	iostats_pool_t *ip;
+
+	for (uint_t i = 0; i < iostats_npools; i++) {
+		if (strcmp(iostats_pools[i].ip_name, pool_name) == 0)
+			return (&iostats_pools[i]);
 	}
+	iostats_pools = xrealloc(iostats_pools,
+	    (iostats_npools + 1) * sizeof (iostats_pool_t));
+	ip = &iostats_pools[iostats_npools++];
+	(void) memset(ip, 0, sizeof (*ip));
+	ip->ip_name = xasprintf("%s", pool_name);
+	ip->ip_label = escape_label(pool_name);
+	ip->ip_file.kf_path = xasprintf(KSTAT_BASE "/%s/iostats", pool_name);
+	ip->ip_file.kf_fd = -1;
+	ip->ip_io_file.kf_path = xasprintf(KSTAT_BASE "/%s/io", pool_name);
+	ip->ip_io_file.kf_fd = -1;
+	return (ip);
+}
 
-	vdev_desc = get_vdev_desc(nvroot, parent_name);
+/*
+ * add a descriptor for a counter not seen before, or return -1 if its
+ * name cannot be used in a metric name
+ */
+int
+iostats_add_named(char *name, size_t len) {
+	kstat_named_t *kn;
 
-	for (int i = 0; size_type[i].name; i++) {
-	if (nvlist_lookup_uint64_array(nv_ex,
-		size_type[i].name, (uint64_t **) &size_array, &c) != 0) {
-		fprintf(stderr, "error: can't get %s\n",
-			size_type[i].name);
-		return (3);
+	for (size_t i = 0; i < len; i++) {
+		if (!((name[i] >= 'a' && name[i] <= 'z') ||
+		    (name[i] >= 'A' && name[i] <= 'Z') ||
+		    (name[i] >= '0' && name[i] <= '9') || name[i] == '_'))
+			return (-1);
 	}
-	/* count */
-	sum = 0;
-	end = c - 1;
-	(void) snprintf(metric_name, sizeof(metric_name),
-	    "%s_%s_bytes", p, size_type[i].short_name);
-	print_help_type(metric_name, "I/O request size distribution",
-	    "histogram");
-
-	for (int j = 0; j <= end; j++) {
-		sum += size_array[j];
-		(void) snprintf(s, sizeof(s),
-			"%s_bytes_bucket", size_type[i].short_name);
-
-		if (j >= MIN_SIZE_INDEX && j <= end) {
-		(void) snprintf(t, sizeof(t),
-				"name=\"%s\",%s,le=\"%d\"",
-				pool_name, vdev_desc, 1 << j);
-		print_prom_u64(p, s, t, sum,
-				   NULL, NULL);
-		}
-		if (j == end) {
-		(void) snprintf(t, sizeof(t),
-				"name=\"%s\",%s,le=\"+Inf\"",
-				pool_name, vdev_desc);
-		print_prom_u64(p, s, t, sum,
-				   NULL, NULL);
+	iostats_named = xrealloc(iostats_named,
+	    (iostats_nnamed + 1) * sizeof (kstat_named_t));
+	kn = &iostats_named[iostats_nnamed];
+	kn->kn_name = xasprintf("%.*s", (int)len, name);
+	kn->kn_metric = kn->kn_name;
+	kn->kn_help = xasprintf("%s, from the pool iostats kstat",
+	    kn->kn_name);
+	kn->kn_type = "counter";
+	return (iostats_nnamed++);
+}
 
-		/*
-		 * TODO: zpool code update to include sum?
-		 * Though sum is useless here and arguably redundant with other
-		 * I/O size measurements. Does it makes sense to sum?
-		 */
-		(void) snprintf(s, sizeof(s),
-				"%s_bytes_sum", size_type[i].short_name);
-		(void) snprintf(t, sizeof(t),
-				"name=\"%s\",%s",
-				pool_name, vdev_desc);
-		print_prom_u64(p, s, t, 0, NULL, NULL);
+void
+iostats_collect(char *pool_name) {
+	iostats_pool_t *ip = iostats_pool_lookup(pool_name);
+	char *p, *name, *type, *value;
+	size_t name_len, type_len, value_len;
+	uint_t hint = 0;
+	int i;
 
-		(void) snprintf(s, sizeof(s),
-				"%s_bytes_count", size_type[i].short_name);
-		print_prom_u64(p, s, t, sum, NULL, NULL);
+	ip->ip_present = B_TRUE;
+	ip->ip_seen = B_FALSE;
+	if (kstat_read(&ip->ip_file) != 0)
+		return;
+	ip->ip_seen = B_TRUE;
+	if (ip->ip_alloc != 0)
+		(void) memset(ip->ip_valid, 0,
+		    ip->ip_alloc * sizeof (boolean_t));
+
+	p = kstat_next_line(kstat_next_line(ip->ip_file.kf_buf));
+	for (; *p != '\0'; p = kstat_next_line(p)) {
+		name = kstat_token(&p, &name_len);
+		type = kstat_token(&p, &type_len);
+		value = kstat_token(&p, &value_len);
+		if (value_len == 0 || type_len != 1 ||
+		    *type - '0' != KSTAT_DATA_UINT64_TYPE)
+			continue;
+		if ((i = kstat_named_find(iostats_named, iostats_nnamed, hint,
+		    name, name_len)) < 0 &&
+		    (i = iostats_add_named(name, name_len)) < 0)
+			continue;
+		if (i >= ip->ip_alloc) {
+			ip->ip_val = xrealloc(ip->ip_val,
+			    iostats_nnamed * sizeof (uint64_t));
+			ip->ip_valid = xrealloc(ip->ip_valid,
+			    iostats_nnamed * sizeof (boolean_t));
+			(void) memset(&ip->ip_valid[ip->ip_alloc], 0,
+			    (iostats_nnamed - ip->ip_alloc) *
+			    sizeof (boolean_t));
+			ip->ip_alloc = iostats_nnamed;
 		}
+		ip->ip_val[i] = kstat_value(value, value_len);
+		ip->ip_valid[i] = B_TRUE;
+		hint = i + 1;
 	}
+}
+
+void
+iostats_io_collect(char *pool_name) {
+	iostats_pool_t *ip = iostats_pool_lookup(pool_name);
+	char *names, *values, *name, *value;
+	size_t name_len, value_len;
+	int i;
+
+	ip->ip_present = B_TRUE;
+	ip->ip_io_seen = B_FALSE;
+	if (kstat_read(&ip->ip_io_file) != 0)
+		return;
+	ip->ip_io_seen = B_TRUE;
+
+	/* skip the kstat header */
+	names = kstat_next_line(ip->ip_io_file.kf_buf);
+	values = kstat_next_line(names);
+	for (;;) {
+		name = kstat_token(&names, &name_len);
+		value = kstat_token(&values, &value_len);
+		if (name_len == 0 || value_len == 0)
+			break;
+		if ((i = kstat_named_find(io_named, IO_STATS, 0, name,
+		    name_len)) >= 0)
+			ip->ip_io[i] = kstat_value(value, value_len);
 	}
-	return (0);
 }
 
 /*
- * ZIO scheduler queue stats are stored as gauges. This is unfortunate
- * because the values can change very rapidly and any point-in-time
- * value will quickly be obsoleted. It is also not easy to downsample.
- * Thus only the top-level queue stats might be beneficial... maybe.
+ * drop the pools whose kstat directory was not found in the last walk
  */
-int
-print_queue_stats(nvlist_t *nvroot, const char *pool_name,
-                  const char *parent_name) {
-	nvlist_t *nv_ex;
-	uint64_t value;
-	char *p = POOL_QUEUE_MEASUREMENT;
-	char s[2 * ZFS_MAX_DATASET_NAME_LEN];
-
-	/* short_names become part of the metric name */
-	struct queue_lookup {
-		char *name;
-		char *short_name;
-	};
-	struct queue_lookup queue_type[] = {
-		{ZPOOL_CONFIG_VDEV_SYNC_R_ACTIVE_QUEUE,  "sync_r_active_queue"},
-		{ZPOOL_CONFIG_VDEV_SYNC_W_ACTIVE_QUEUE,  "sync_w_active_queue"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_R_ACTIVE_QUEUE, "async_r_active_queue"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_W_ACTIVE_QUEUE, "async_w_active_queue"},
-		{ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,  "async_scrub_active_queue"},
-		{ZPOOL_CONFIG_VDEV_SYNC_R_PEND_QUEUE,	"sync_r_pend_queue"},
-		{ZPOOL_CONFIG_VDEV_SYNC_W_PEND_QUEUE,	"sync_w_pend_queue"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_R_PEND_QUEUE,   "async_r_pend_queue"},
-		{ZPOOL_CONFIG_VDEV_ASYNC_W_PEND_QUEUE,   "async_w_pend_queue"},
-		{ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,     "async_scrub_pend_queue"},
-		{NULL,                                   NULL}
-	};
+void
+iostats_pools_prune(void) {
+	iostats_pool_t *ip;
+	uint_t i, n = 0;
 
-	if (nvlist_lookup_nvlist(nvroot,
-	    ZPOOL_CONFIG_VDEV_STATS_EX, &nv_ex) != 0) {
-		return (6);
+	for (i = 0; i < iostats_npools; i++) {
+		ip = &iostats_pools[i];
+		if (!ip->ip_present) {
+			kstat_close(&ip->ip_file);
+			kstat_close(&ip->ip_io_file);
+			free(ip->ip_name);
+			free(ip->ip_label);
+			free(ip->ip_val);
+			free(ip->ip_valid);
+			continue;
+		}
+		ip->ip_present = B_FALSE;
+		iostats_pools[n++] = *ip;
 	}
+	iostats_npools = n;
+}
 
-	(void) snprintf(s, sizeof(s), "name=\"%s\",%s",
-	    pool_name, get_vdev_desc(nvroot, parent_name));
+void
+print_iostats(void) {
+	char metric_name[200];
+	iostats_pool_t *ip;
 
-	for (int i = 0; queue_type[i].name; i++) {
-		if (nvlist_lookup_uint64(nv_ex,
-		    queue_type[i].name, (uint64_t *) &value) != 0) {
-			fprintf(stderr, "error: can't get %s\n",
-			    queue_type[i].name);
-			return (3);
+	for (uint_t s = 0; s < iostats_nnamed; s++) {
+		(void) snprintf(metric_name, sizeof (metric_name), "%s_%s",
+		    IOSTATS_MEASUREMENT, iostats_named[s].kn_metric);
+		print_help_type(metric_name, iostats_named[s].kn_help,
+		    iostats_named[s].kn_type);
+		for (uint_t i = 0; i < iostats_npools; i++) {
+			ip = &iostats_pools[i];
+			if (!ip->ip_seen || s >= ip->ip_alloc ||
+			    !ip->ip_valid[s])
+				continue;
+			(void) printf("%s{name=\"%s\"} ", metric_name,
+			    ip->ip_label);
+			print_value_u64(ip->ip_val[s]);
 		}
-		print_prom_u64(p, queue_type[i].short_name, s, value,
-		    "queue depth", "gauge");
 	}
-	return (0);
+	for (uint_t s = 0; s < IO_STATS; s++) {
+		if (!KFAMILY_ON(KG_IO, s))
+			continue;
+		print_kfamily_header(KG_IO, s);
+		for (uint_t i = 0; i < iostats_npools; i++) {
+			ip = &iostats_pools[i];
+			if (!ip->ip_io_seen)
+				continue;
+			(void) printf("%s{name=\"%s\"} ",
+			    families[KFAMILY_ID(KG_IO, s)].fd_name,
+			    ip->ip_label);
+			print_value_u64(ip->ip_io[s]);
+		}
+	}
+	for (uint_t i = 0; i < iostats_npools; i++) {
+		iostats_pools[i].ip_seen = B_FALSE;
+		iostats_pools[i].ip_io_seen = B_FALSE;
+	}
 }
 
 /*
- * Summary stats for each vdev are familiar to the "zpool status"
- * and "zpool list" users.
+ * With -E, a thread consumes the ZFS event stream, blocking in
+ * zpool_events_next() until an event arrives, and counts the events by
+ * class, pool, and vdev. The most recent EVENT_RING events are also kept
+ * and exported with their details as labels. The thread has its own
+ * libzfs handle, zevent descriptor, and string arena, and only takes
+ * event_lock to update the counters.
+ *
+ * To bound the cardinality, at most EVENT_MAX_COUNTERS combinations of
+ * class, pool, and vdev are counted, further ones only in a total.
  */
-int
-print_summary_stats(nvlist_t *nvroot, const char *pool_name,
-                    const char *parent_name) {
-	uint_t c;
-	vdev_stat_t *vs;
-	char *p = POOL_MEASUREMENT;
-	char l[2 * ZFS_MAX_DATASET_NAME_LEN];
-	char *vdev_desc = get_vdev_desc(nvroot, parent_name);
+#define	EVENT_MAX_COUNTERS	1024
+#define	EVENT_RING		32
+#define	EVENT_LABEL_LEN		256
+#define	EVENT_CLASS		"class"
+#define	EVENT_POOL		"pool"
+#define	EVENT_VDEV_PATH		"vdev_path"
+#define	EVENT_VDEV_GUID		"vdev_guid"
+#define	EVENT_EID		"eid"
+#define	EVENT_TIME		"time"
 
-	if (nvlist_lookup_uint64_array(nvroot,
-	    ZPOOL_CONFIG_VDEV_STATS, (uint64_t **) &vs, &c) != 0) {
-		return (0);
+typedef struct event_counter {
+	char		*ec_class;		/* labels are escaped */
+	char		*ec_pool;
+	char		*ec_vdev;
+	uint64_t	ec_count;
+} event_counter_t;
+
+typedef struct event_recent {
+	uint64_t	er_eid;
+	double		er_time;
+	char		er_class[EVENT_LABEL_LEN];
+	char		er_pool[EVENT_LABEL_LEN];
+	char		er_vdev[EVENT_LABEL_LEN];
+} event_recent_t;
+
+pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+event_counter_t event_counters[EVENT_MAX_COUNTERS];
+uint_t event_ncounters = 0;
+uint64_t event_overflow = 0;	/* events not counted by labels */
+uint64_t event_dropped = 0;	/* events lost by the kernel */
+event_recent_t event_ring[EVENT_RING];
+uint64_t event_seq = 0;		/* events seen, ring slot is modulo */
+boolean_t event_started = B_FALSE;	/* with -E */
+boolean_t event_running = B_FALSE;	/* until the thread stops */
+
+/*
+ * escaped label for a ring slot, truncated before it is escaped so that
+ * an escape sequence is never cut in half
+ */
+char *
+event_ring_label(arena_t *a, char *s) {
+	char raw[EVENT_LABEL_LEN / 2];
+
+	(void) snprintf(raw, sizeof (raw), "%s", s);
+	return (escape_string(a, raw));
+}
+
+void
+event_count(nvlist_t *nvl, arena_t *a) {
+	char *class, *pool, *path, guid[32];
+	char *vdev = "";
+	char *ring_class, *ring_pool, *ring_vdev;
+	uint64_t v;
+	int64_t *t;
+	uint_t n, i;
+	event_counter_t *ec;
+	event_recent_t *er;
+	arena_mark_t m;
+
+	if (nvlist_lookup_string(nvl, EVENT_CLASS, &class) != 0)
+		return;
+	if (nvlist_lookup_string(nvl, EVENT_POOL, &pool) != 0)
+		pool = "";
+	if (nvlist_lookup_string(nvl, EVENT_VDEV_PATH, &path) == 0) {
+		vdev = path;
+	} else if (nvlist_lookup_uint64(nvl, EVENT_VDEV_GUID, &v) == 0) {
+		(void) snprintf(guid, sizeof (guid), "0x%"PRIx64, v);
+		vdev = guid;
 	}
-	/*
-	 * Include the state of the vdev as a prometheus label. This allows
-	 * for filtering in queries. However, these do no map directly to all
-	 * of the possible human-readable names in the zpool(8) command output.
-	 * For example, a healthy spare has state "AVAIL" in zpool, but "ONLINE" here.
-	 */
-	(void) snprintf(l, sizeof(l), "name=\"%s\",state=\"%s\",%s",
-	    pool_name, zpool_state_to_name(vs->vs_state, vs->vs_aux),
-            vdev_desc);
 
-	/* Show the raw state enums. See zfs.h for the current descriptions	 */
-	print_prom_u64(p, "state", l, vs->vs_state, "current state, see zfs.h",
-	    "gauge");
-	print_prom_u64(p, "aux_state", l, vs->vs_aux, "auxiliary state, see zfs.h",
-        "gauge");
-
-	print_prom_u64(p, "alloc_bytes", l, vs->vs_alloc,
-	    "allocated size", "gauge");
-	print_prom_u64(p, "free_bytes", l, vs->vs_space - vs->vs_alloc,
-	    "free space", "gauge");
-	print_prom_u64(p, "size_bytes", l, vs->vs_space,
-	    "pool size", "gauge");
-
-	print_prom_u64(p, "read_bytes", l, vs->vs_bytes[ZIO_TYPE_READ],
-	    "read bytes", "counter");
-	print_prom_u64(p, "read_errors", l, vs->vs_read_errors,
-	    "read errors", "counter");
-	print_prom_u64(p, "read_ops", l, vs->vs_ops[ZIO_TYPE_READ],
-	    "read ops", "counter");
-
-	print_prom_u64(p, "write_bytes", l, vs->vs_bytes[ZIO_TYPE_WRITE],
-	    "write bytes", "counter");
-	print_prom_u64(p, "write_errors", l, vs->vs_write_errors,
-	    "write errors", "counter");
-	print_prom_u64(p, "write_ops", l, vs->vs_ops[ZIO_TYPE_WRITE],
-	    "write ops", "counter");
-
-	print_prom_u64(p, "cksum_errors", l, vs->vs_checksum_errors,
-	    "checksum errors", "counter");
-	print_prom_u64(p, "fragmentation_ratio", l, vs->vs_fragmentation / 100,
-	    "free space fragmentation metric", "gauge");
+	arena_mark(a, &m);
+	ring_class = event_ring_label(a, class);
+	ring_pool = event_ring_label(a, pool);
+	ring_vdev = event_ring_label(a, vdev);
+	class = escape_string(a, class);
+	pool = escape_string(a, pool);
+	vdev = escape_string(a, vdev);
 
-	return (0);
+	(void) pthread_mutex_lock(&event_lock);
+	for (i = 0, ec = event_counters; i < event_ncounters; i++, ec++) {
+		if (strcmp(ec->ec_class, class) == 0 &&
+		    strcmp(ec->ec_pool, pool) == 0 &&
+		    strcmp(ec->ec_vdev, vdev) == 0)
+			break;
+	}
+	if (i == event_ncounters && i < EVENT_MAX_COUNTERS) {
+		ec->ec_class = xasprintf("%s", class);
+		ec->ec_pool = xasprintf("%s", pool);
+		ec->ec_vdev = xasprintf("%s", vdev);
+		ec->ec_count = 0;
+		event_ncounters++;
+	}
+	if (i < EVENT_MAX_COUNTERS)
+		ec->ec_count++;
+	else
+		event_overflow++;
+
+	er = &event_ring[event_seq++ % EVENT_RING];
+	if (nvlist_lookup_uint64(nvl, EVENT_EID, &er->er_eid) != 0)
+		er->er_eid = event_seq;
+	/* posted as an int64 array of seconds and nanoseconds */
+	if (nvlist_lookup_int64_array(nvl, EVENT_TIME, &t, &n) == 0 && n >= 2)
+		er->er_time = t[0] + t[1] / 1e9;
+	else
+		er->er_time = time(NULL);
+	(void) strcpy(er->er_class, ring_class);
+	(void) strcpy(er->er_pool, ring_pool);
+	(void) strcpy(er->er_vdev, ring_vdev);
+	(void) pthread_mutex_unlock(&event_lock);
+	arena_release(a, &m);
 }
 
 /*
- * recursive stats printer
+ * the counts are no longer kept once the thread stops, so they are no
+ * longer exported, and zfs_events_up tells why
  */
-typedef int (*stat_printer_f)(nvlist_t *, const char *, const char *);
+void
+event_stop(void) {
+	(void) pthread_mutex_lock(&event_lock);
+	event_running = B_FALSE;
+	(void) pthread_mutex_unlock(&event_lock);
+}
 
-int
-print_recursive_stats(stat_printer_f func, nvlist_t *nvroot,
-                      const char *pool_name, const char *parent_name,
-                      int descend) {
-	uint_t c, children;
-	nvlist_t **child;
-	char vdev_name[256];
-	int err;
+void *
+event_thread(void *arg) {
+	libzfs_handle_t *hdl;
+	nvlist_t *nvl;
+	arena_t a = { 0 };
+	int fd, dropped;
 
-	err = func(nvroot, pool_name, parent_name);
-	if (err)
-		return (err);
+	if ((hdl = libzfs_init()) == NULL ||
+	    (fd = open(ZFS_DEV, O_RDWR)) < 0) {
+		fprintf(stderr, "error: cannot read ZFS events\n");
+		event_stop();
+		return (NULL);
+	}
+	for (;;) {
+		if (zpool_events_next(hdl, &nvl, &dropped, ZEVENT_NONE,
+		    fd) != 0)
+			break;
+		if (dropped > 0) {
+			(void) pthread_mutex_lock(&event_lock);
+			event_dropped += dropped;
+			(void) pthread_mutex_unlock(&event_lock);
+		}
+		if (nvl == NULL)
+			continue;
+		event_count(nvl, &a);
+		nvlist_free(nvl);
+	}
+	fprintf(stderr, "error: stopped reading ZFS events\n");
+	event_stop();
+	(void) close(fd);
+	libzfs_fini(hdl);
+	return (NULL);
+}
 
-	if (descend && nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
-	    &child, &children) == 0) {
-		(void) strncpy(vdev_name, get_vdev_name(nvroot, parent_name),
-		    sizeof(vdev_name));
-		vdev_name[sizeof(vdev_name) - 1] = '\0';
+void
+event_start(void) {
+	pthread_t tid;
 
-		for (c = 0; c < children; c++) {
-			print_recursive_stats(func, child[c], pool_name,
-			    vdev_name, descend);
-		}
+	event_started = B_TRUE;
+	event_running = B_TRUE;
+	if (pthread_create(&tid, NULL, event_thread, NULL) != 0) {
+		fprintf(stderr, "error: cannot start the event thread\n");
+		exit(1);
 	}
-	return (0);
+	(void) pthread_detach(tid);
 }
 
 /*
- * call-back to print the stats from the pool config
- *
- * Note: if the pool is broken, this can hang indefinitely
+ * The counts and the ring are copied under event_lock, and printed after
+ * it is released, so that a slow reader of stdout does not stall the
+ * event thread. The label strings of the counters never change once
+ * they are counted, so only the counts are copied.
  */
-int
-print_stats(zpool_handle_t *zhp, void *data) {
-	uint_t c;
-	int err = 0;
-	boolean_t missing;
-	nvlist_t *nv, *nv_ex, *config, *nvroot;
-	vdev_stat_t *vs;
-	uint64_t *lat_array;
-	char *pool_name;
-	pool_scan_stat_t *ps = NULL;
+void
+print_event_stats(void) {
+	static uint64_t counts[EVENT_MAX_COUNTERS];
+	static event_recent_t ring[EVENT_RING];
+	event_counter_t *ec;
+	event_recent_t *er;
+	uint64_t overflow, dropped, seq, first;
+	boolean_t running;
+	uint_t n;
 
-	/* if not this pool return quickly */
-	if (data &&
-	    strncmp(data, zhp->zpool_name, ZFS_MAX_DATASET_NAME_LEN) != 0)
-		return (0);
+	if (!event_started)
+		return;
+	(void) pthread_mutex_lock(&event_lock);
+	running = event_running;
+	n = event_ncounters;
+	for (uint_t i = 0; i < n; i++)
+		counts[i] = event_counters[i].ec_count;
+	overflow = event_overflow;
+	dropped = event_dropped;
+	seq = event_seq;
+	(void) memcpy(ring, event_ring, sizeof (ring));
+	(void) pthread_mutex_unlock(&event_lock);
 
-	if (zpool_refresh_stats(zhp, &missing) != 0)
-		return (1);
+	print_prom_u64(EVENT_MEASUREMENT, "up", NULL, running,
+	    "1 while the ZFS events are being read", "gauge");
+	if (!running)
+		return;
 
-	config = zpool_get_config(zhp, NULL);
+	print_help_type(EVENT_MEASUREMENT "_total",
+	    "ZFS events by class, pool, and vdev", "counter");
+	for (uint_t i = 0; i < n; i++) {
+		ec = &event_counters[i];
+		(void) printf(EVENT_MEASUREMENT "_total{class=\"%s\","
+		    "name=\"%s\",vdev=\"%s\"} ", ec->ec_class, ec->ec_pool,
+		    ec->ec_vdev);
+		print_value_u64(counts[i]);
+	}
+	print_prom_u64(EVENT_MEASUREMENT, "uncounted_total", NULL,
+	    overflow, "ZFS events over the label limit", "counter");
+	print_prom_u64(EVENT_MEASUREMENT, "dropped_total", NULL,
+	    dropped, "ZFS events dropped before being read", "counter");
 
-	if (nvlist_lookup_nvlist(
-	    config, ZPOOL_CONFIG_VDEV_TREE, &nvroot) != 0) {
-		return (2);
+	print_help_type(EVENT_MEASUREMENT "_recent_timestamp_seconds",
+	    "time of the most recent ZFS events", "gauge");
+	first = seq > EVENT_RING ? seq - EVENT_RING : 0;
+	for (uint64_t i = first; i < seq; i++) {
+		er = &ring[i % EVENT_RING];
+		(void) printf(EVENT_MEASUREMENT "_recent_timestamp_seconds{"
+		    "class=\"%s\",name=\"%s\",vdev=\"%s\",eid=\"%"PRIu64"\"} "
+		    "%f\n", er->er_class, er->er_pool, er->er_vdev,
+		    er->er_eid, er->er_time);
 	}
-	if (nvlist_lookup_uint64_array(nvroot,
-	    ZPOOL_CONFIG_VDEV_STATS,
-	    (uint64_t **) &vs, &c) != 0) {
-		return (3);
+}
+
+/*
+ * fill in the descriptors of the kstat groups, after init_families(),
+ * and size the family sets
+ */
+void
+init_kstat_families(void) {
+	family_desc_t *fd;
+
+	init_histo_family(&txg_sync_names, TXG_MEASUREMENT, "sync",
+	    "seconds");
+	init_histo_family(&txg_dirty_names, TXG_MEASUREMENT, "dirty",
+	    "bytes");
+	init_histo_family(&dmu_tx_names, DMU_TX_MEASUREMENT, "delay",
+	    "seconds");
+	for (int j = 0; j < TXG_DIRTY_BUCKETS; j++)
+		txg_dirty_le[j] = xasprintf(",le=\"%"PRIu64"\"} ",
+		    1ULL << (j + TXG_DIRTY_MIN_INDEX));
+
+	family_kcount[KG_PROPS] = POOL_PROPS + 1;	/* and the features */
+	family_kcount[KG_TXG] = 2;
+	family_kcount[KG_DMU_TX] = 1;
+	family_kcount[KG_DATASET] = OBJSET_STATS;
+	family_kcount[KG_IO] = IO_STATS;
+	for (int k = 0; k < KG_GROUPS; k++) {
+		family_kbase[k] = nfamilies;
+		nfamilies += family_kcount[k];
 	}
+	families = xrealloc(families, nfamilies * sizeof (family_desc_t));
+	family_words = (nfamilies + 63) / 64;
 
-	pool_name = escape_string(zhp->zpool_name);
-	printf("### %s stats for %s\n", COMMAND_NAME, pool_name);
-
-	err = print_recursive_stats(print_summary_stats, nvroot,
-	    pool_name, NULL, 1);
-	if (err == 0)
-		err = print_recursive_stats(print_vdev_latency_stats, nvroot,
-		    pool_name, NULL, 1);
-	if (err == 0)
-		err = print_recursive_stats(print_vdev_size_stats, nvroot,
-		    pool_name, NULL, 1);
-	if (err == 0)
-		err = print_recursive_stats(print_queue_stats, nvroot,
-		    pool_name, NULL, 0);
-	if (err == 0)
-		err = print_scan_status(nvroot, pool_name);
-
-	free(pool_name);
-	return (0);
+	for (int i = 0; i < POOL_PROPS; i++) {
+		fd = &families[KFAMILY_ID(KG_PROPS, i)];
+		fd->fd_name = xasprintf("%s_%s", PROPS_MEASUREMENT,
+		    pool_prop_desc[i].name);
+		fd->fd_help = pool_prop_desc[i].help;
+		fd->fd_type = "gauge";
+	}
+	fd = &families[KFAMILY_ID(KG_PROPS, POOL_PROPS)];
+	fd->fd_name = PROPS_MEASUREMENT "_feature";
+	fd->fd_help = "feature state: 0 disabled, 1 enabled, 2 active";
+	fd->fd_type = "gauge";
+
+	fd = &families[KFAMILY_ID(KG_TXG, 0)];
+	fd->fd_name = txg_sync_names.family;
+	fd->fd_help = "TXG sync time";
+	fd->fd_type = "histogram";
+	fd = &families[KFAMILY_ID(KG_TXG, 1)];
+	fd->fd_name = txg_dirty_names.family;
+	fd->fd_help = "dirty data synced per TXG";
+	fd->fd_type = "histogram";
+	fd = &families[KFAMILY_ID(KG_DMU_TX, 0)];
+	fd->fd_name = dmu_tx_names.family;
+	fd->fd_help = "time waited to assign a transaction to a TXG";
+	fd->fd_type = "histogram";
+
+	for (int i = 0; i < OBJSET_STATS; i++) {
+		fd = &families[KFAMILY_ID(KG_DATASET, i)];
+		fd->fd_name = xasprintf("%s_%s", DATASET_MEASUREMENT,
+		    objset_named[i].kn_metric);
+		fd->fd_help = objset_named[i].kn_help;
+		fd->fd_type = objset_named[i].kn_type;
+	}
+	for (int i = 0; i < IO_STATS; i++) {
+		fd = &families[KFAMILY_ID(KG_IO, i)];
+		fd->fd_name = xasprintf("%s_%s", IO_MEASUREMENT,
+		    io_named[i].kn_metric);
+		fd->fd_help = io_named[i].kn_help;
+		fd->fd_type = io_named[i].kn_type;
+	}
 }
 
+/*
+ * Collect the per-pool kstats. Pools are found from the kstat
+ * directories rather than from libzfs, so this takes no spa_config lock
+ * and needs no ioctl, see -k.
+ */
+void
+collect_pool_kstats(char *pool_filter) {
+	DIR *dir;
+	struct dirent *de;
+
+	if ((dir = opendir(KSTAT_BASE)) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' ||
+		    (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+			continue;
+		if (pool_filter != NULL && strcmp(pool_filter, de->d_name) != 0)
+			continue;
+		if (KGROUP_ON(KG_TXG))
+			txg_collect(de->d_name);
+		if (KGROUP_ON(KG_DMU_TX))
+			dmu_tx_collect(de->d_name);
+		if (KGROUP_ON(KG_DATASET))
+			objset_collect(de->d_name);
+		iostats_collect(de->d_name);
+		if (KGROUP_ON(KG_IO))
+			iostats_io_collect(de->d_name);
+	}
+	(void) closedir(dir);
+	/* the pools of the groups not read are left for the next walk */
+	if (KGROUP_ON(KG_TXG) || KGROUP_ON(KG_DMU_TX))
+		txg_pools_prune();
+	if (KGROUP_ON(KG_DATASET))
+		objset_pools_prune();
+	iostats_pools_prune();
+}
+
+void
+usage(char *name) {
+	fprintf(stderr, "usage: %s [-e] [-s] [-m kbytes] [-k | -r seconds] [-E] "
+	    "[-p seconds] [-K kstats]\n"
+	    "       [-d group=depth,...] [-L labels] [-c series] [-i patterns]\n"
+	    "       [-x patterns] [-f filter_file] [pool_name]\n"
+	    "  -e         run until stdin closes, printing the stats "
+	    "for each line read\n"
+	    "  -s         stream the output with bounded memory\n"
+	    "  -m kbytes  memory limit for the stats snapshot when "
+	    "streaming (default %d)\n"
+	    "  -k         kstats only, do not use libzfs\n"
+	    "  -E         with -e, count ZFS events as they arrive\n"
+	    "  -r seconds refresh the pool configs at most this often, "
+	    "with -e\n"
+	    "  -p seconds refresh the pool properties at most this often, "
+	    "with -e\n"
+	    "             (default %d)\n"
+	    "  -K kstats  global kstats to read, of arcstats, zil, "
+	    "zfetchstats,\n"
+	    "             dbufstats, abdstats, dmu_tx (default arcstats)\n"
+	    "  -d group=depth,...\n"
+	    "             deepest vdevs to report for a metric group, of "
+	    "summary, leaf,\n"
+	    "             progress, latency, size, queue (0 is the root)\n"
+	    "  -L labels  vdev labels to omit, of class, guid, path, devid,\n"
+	    "             phys_path, by_id\n"
+	    "  -c series  at most this many vdev series, dropping the "
+	    "deepest vdevs\n"
+	    "  -i patterns\n"
+	    "             pool metric families to include, as comma "
+	    "separated globs\n"
+	    "  -x patterns\n"
+	    "             pool metric families to exclude\n"
+	    "  -f filter_file\n"
+	    "             include and exclude patterns, one per line\n",
+	    name, STREAM_MEMORY_KB, PROP_REFRESH_SECS);
+	exit(1);
+}
+
+/*
+ * in execd mode, wait for a line on stdin before each collection.
+ * A line too long for the buffer is truncated.
+ */
+boolean_t
+wait_for_line(char *line, size_t len) {
+	size_t n = 0;
+	int c;
+
+	while ((c = getchar()) != EOF) {
+		if (c == '\n') {
+			line[n] = '\0';
+			return (B_TRUE);
+		}
+		if (n < len - 1)
+			line[n++] = c;
+	}
+	return (B_FALSE);
+}
 
 int
 main(int argc, char *argv[]) {
-	libzfs_handle_t *g_zfs;
-	if ((g_zfs = libzfs_init()) == NULL) {
+	int err, opt;
+	boolean_t execd = B_FALSE;
+	boolean_t kstat_only = B_FALSE;
+	boolean_t events = B_FALSE;
+	size_t stream_kb = STREAM_MEMORY_KB;
+	time_t refresh_secs = 0;
+	static char stream_buf[STREAM_CHUNK];
+	libzfs_handle_t *g_zfs = NULL;
+	char *pool_filter;
+	struct timespec ts;
+	static char line[SCRAPE_LINE_MAX];
+	family_set_t collected;			/* families in the snapshot */
+	family_set_t *scrape_on;
+	boolean_t expired;
+
+	for (int g = 0; g < FG_GROUPS; g++)
+		group_max_depth[g] = DEPTH_UNLIMITED;
+	while ((opt = getopt(argc, argv, "eskEm:r:p:K:d:L:c:i:x:f:")) != -1) {
+		switch (opt) {
+			case 'e':
+				execd = B_TRUE;
+				break;
+			case 's':
+				stream_output = B_TRUE;
+				break;
+			case 'm':
+				stream_kb = strtoul(optarg, NULL, 10);
+				break;
+			case 'k':
+				kstat_only = B_TRUE;
+				break;
+			case 'E':
+				events = B_TRUE;
+				break;
+			case 'r':
+				refresh_secs = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				prop_refresh_secs = strtoul(optarg, NULL, 10);
+				break;
+			case 'K':
+				if (named_stats_enable(optarg) != 0)
+					usage(argv[0]);
+				break;
+			case 'd':
+				if (depth_limits_parse(optarg) != 0)
+					usage(argv[0]);
+				break;
+			case 'L':
+				if (labels_omit_parse(optarg) != 0)
+					usage(argv[0]);
+				break;
+			case 'c':
+				series_cap = strtoull(optarg, NULL, 10);
+				break;
+			case 'i':
+				family_filter_add(&family_filter, B_TRUE,
+				    optarg);
+				break;
+			case 'x':
+				family_filter_add(&family_filter, B_FALSE,
+				    optarg);
+				break;
+			case 'f':
+				if (family_filter_load(&family_filter,
+				    optarg) != 0)
+					exit(1);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1 || (kstat_only && refresh_secs != 0) ||
+	    (events && (kstat_only || !execd)))
+		usage(argv[0]);
+	pool_filter = optind < argc ? argv[optind] : NULL;
+
+	if (!kstat_only && (g_zfs = libzfs_init()) == NULL) {
 		fprintf(stderr,
 		    "error: cannot initialize libzfs. "
 		    "Is the zfs module loaded or zrepl running?");
 		exit(1);
 	}
-	if (nvlist_alloc(&metric_names, NV_UNIQUE_NAME, 0) != 0) {
-	    fprintf(stderr, "error: cannot allocate memory");
-	    exit(1);
-	}
-	if (argc > 1) {
-		return (zpool_iter(g_zfs, print_stats, argv[1]));
-	} else {
-		return (zpool_iter(g_zfs, print_stats, NULL));
+	histo_cumulate_init();
+	init_histo_names();
+	init_families();
+	init_kstat_families();
+	family_set_init(&family_config);
+	family_set_init(&collected);
+	if (family_set_compile(&family_config, &family_filter) == 0)
+		fprintf(stderr, "warning: no pool metric family matches the "
+		    "filter\n");
+	if (events)
+		event_start();
+
+	if (stream_output) {
+		/* stdout is written in fixed size chunks */
+		(void) setvbuf(stdout, stream_buf, _IOFBF, sizeof (stream_buf));
+		snap.sn_vdev_limit = stream_kb * 1024 / snapshot_vdev_bytes();
+		if (snap.sn_vdev_limit == 0)
+			snap.sn_vdev_limit = 1;
 	}
+
+	/*
+	 * In execd mode, a collection is made for each line read on stdin,
+	 * and EXECD_EOF marks the end of its output. This lets a long-running
+	 * server, such as serve_zpool_prometheus.py, keep a single instance.
+	 *
+	 * The pool configs are only refreshed every refresh_secs, as this
+	 * takes the spa_config lock. In between, the previous snapshot is
+	 * printed again. The kstats are read for every collection.
+	 */
+	err = 0;
+	do {
+		if (execd && !wait_for_line(line, sizeof (line)))
+			break;
+		if (execd)
+			family_on = scrape_filter_lookup(line);
+		/*
+		 * A scrape wanting families not in the snapshot refreshes it,
+		 * keeping those of the other scrapes until the interval
+		 * expires, so that scrapes with different filters do not
+		 * refresh it in turn. The snapshot is collected for all of
+		 * them, and printed for this one.
+		 */
+		expired = time(NULL) - config_time >= refresh_secs;
+		if (!kstat_only &&
+		    (expired || !family_set_subset(family_on, &collected))) {
+			if (expired)
+				family_set_copy(&collected, family_on);
+			else
+				family_set_union(&collected, family_on);
+			scrape_on = family_on;
+			family_on = &collected;
+			snapshot_reset(&snap);
+			snap.sn_collect = collected.fs_groups;
+			byid_refresh();
+			series_left = series_cap;
+			for (uint_t i = 0; i < pool_nprops; i++)
+				pool_props[i].pp_seen = B_FALSE;
+			(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+			snap.sn_now = ts.tv_sec + ts.tv_nsec / 1e9;
+			err = zpool_iter(g_zfs, collect_stats, pool_filter);
+			scan_rates_prune(&snap);
+			if (KGROUP_ON(KG_PROPS))
+				pool_props_prune();
+			config_time = time(NULL);
+			if (!stream_output)
+				snapshot_cumulate(&snap);
+			family_on = scrape_on;
+		}
+		collect_pool_kstats(pool_filter);
+		for (uint_t i = 0; i < NAMED_STATS; i++) {
+			if (named_stats[i].kc_enabled)
+				(void) kstat_collect_named(&named_stats[i]);
+		}
+		if (ARC_STATS->kc_enabled)
+			l2arc_rates_update(ARC_STATS);
+		if (stream_output && !kstat_only)
+			print_stream(&snap);
+		else if (!kstat_only)
+			print_snapshot(&snap);
+		print_pool_props();
+		print_txg_stats();
+		print_objset_stats();
+		print_iostats();
+		for (uint_t i = 0; i < NAMED_STATS; i++)
+			print_kstat_named(&named_stats[i]);
+		print_l2arc_rates();
+		print_event_stats();
+		print_self_stats(&snap);
+		if (execd) {
+			(void) fputs(EXECD_EOF, stdout);
+			(void) fflush(stdout);
+		}
+	} while (execd);
+
+	return (err);
 }